@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <espeak-ng/speak_lib.h>
+
+/* Synthesis engine used by the process thread. Engines report sound and
+ * events through the callback in the same way espeak_Synth() does in
+ * AUDIO_OUTPUT_SYNCHRONOUS mode; the espeak_EVENT.user_data of every
+ * event is the user_data passed to synth(). */
+typedef struct {
+    const gchar *name;
+
+    /* returns the sample rate, or 0 if the engine is not available */
+    gint (*initialize) (gint buffer_ms);
+    void (*set_callback) (t_espeak_callback *);
+    const espeak_VOICE **(*list_voices) (void);
+    void (*set_parameter) (espeak_PARAMETER, gint value);
+    void (*set_voice) (const gchar *);
+    void (*synth) (const gchar * text, gsize size, guint flags,
+            gpointer user_data);
+} Ebackend;
+
+extern const Ebackend espeak_ng_backend;
+extern const Ebackend fake_backend;
+extern const Ebackend daemon_backend;
+
+#endif
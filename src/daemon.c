@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Engine which delegates synthesis to espeak-daemon, so voices are loaded
+ * once per host instead of once per process. The socket is taken from
+ * GST_ESPEAK_DAEMON, by default "gst-espeak.sock" in the user's runtime
+ * directory. A lost daemon is reconnected on the next request, if that
+ * fails the element keeps speaking with espeak-ng in process.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "backend.h"
+#include "daemon.h"
+
+static gint daemon_fd = -1;
+static gint daemon_buffer_ms = 0;
+static gint daemon_sample_rate = 0;
+static gboolean daemon_local = FALSE;
+static t_espeak_callback *daemon_callback = NULL;
+
+static espeak_VOICE *daemon_voices = NULL;
+static const espeak_VOICE **daemon_voice_list = NULL;
+
+static gint daemon_pitch = 0;
+static gint daemon_rate = 0;
+static gint daemon_gap = 0;
+static gchar *daemon_voice = NULL;
+
+static guint8 *daemon_sound = NULL;
+static gsize daemon_sound_size = 0;
+
+static GByteArray *daemon_payload = NULL;
+static GArray *daemon_events = NULL;
+
+// samples of the current utterance the callback has got from the daemon,
+// and whether it asked to abort it
+static gsize daemon_delivered = 0;
+static gboolean daemon_aborted = FALSE;
+// samples of it the in-process engine has rendered after the daemon went
+// away, see resume_local()
+static gsize daemon_resumed = 0;
+
+// protocol --------------------------------------------------------------------
+
+gchar *daemon_socket_path () {
+    const gchar *path = g_getenv ("GST_ESPEAK_DAEMON");
+
+    if (path)
+        return g_strdup (path);
+
+    return g_build_filename (g_get_user_runtime_dir (), DAEMON_SOCKET_NAME,
+            NULL);
+}
+
+static gboolean write_all (gint fd, const guint8 * data, gsize size) {
+    while (size) {
+        ssize_t written = send (fd, data, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return FALSE;
+        data += written;
+        size -= written;
+    }
+    return TRUE;
+}
+
+static gboolean read_all (gint fd, guint8 * data, gsize size) {
+    while (size) {
+        ssize_t got = read (fd, data, size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return FALSE;
+        data += got;
+        size -= got;
+    }
+    return TRUE;
+}
+
+gboolean daemon_send (gint fd, DaemonMessage type, gconstpointer data,
+        gsize size, gint pass_fd) {
+    DaemonHeader header = { type, size };
+    struct iovec iov = { &header, sizeof (header) };
+    struct msghdr msg = { 0 };
+    union {
+        struct cmsghdr align;
+        gchar buf[CMSG_SPACE (sizeof (gint))];
+    } control;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (pass_fd >= 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof (control.buf);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (gint));
+        memcpy (CMSG_DATA (cmsg), &pass_fd, sizeof (gint));
+    }
+
+    ssize_t sent;
+    do
+        sent = sendmsg (fd, &msg, MSG_NOSIGNAL);
+    while (sent < 0 && errno == EINTR);
+
+    if (sent <= 0)
+        return FALSE;
+
+    // header is tiny, but a stream socket may still take it partially
+    if (!write_all (fd, (const guint8 *) &header + sent,
+                    sizeof (header) - sent))
+        return FALSE;
+
+    return write_all (fd, data, size);
+}
+
+gboolean daemon_receive (gint fd, DaemonHeader * header, GByteArray * payload,
+        gint * passed_fd) {
+    struct iovec iov = { header, sizeof (DaemonHeader) };
+    struct msghdr msg = { 0 };
+    union {
+        struct cmsghdr align;
+        gchar buf[CMSG_SPACE (sizeof (gint))];
+    } control;
+    struct cmsghdr *cmsg;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof (control.buf);
+
+    if (passed_fd)
+        *passed_fd = -1;
+
+    ssize_t got;
+    do
+        got = recvmsg (fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    while (got < 0 && errno == EINTR);
+
+    if (got != sizeof (DaemonHeader))
+        return FALSE;
+
+    for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        gint fd_;
+        memcpy (&fd_, CMSG_DATA (cmsg), sizeof (gint));
+        if (passed_fd)
+            *passed_fd = fd_;
+        else
+            close (fd_);
+    }
+
+    g_byte_array_set_size (payload, header->size);
+
+    return read_all (fd, payload->data, header->size);
+}
+
+// backend ---------------------------------------------------------------------
+
+static void disconnect () {
+    if (daemon_fd >= 0)
+        close (daemon_fd);
+    daemon_fd = -1;
+}
+
+static gboolean parse_voices (GByteArray * payload) {
+    if (payload->len < sizeof (DaemonVoices))
+        return FALSE;
+
+    DaemonVoices *header = (DaemonVoices *) payload->data;
+    const gchar *i = (const gchar *) payload->data + sizeof (DaemonVoices);
+    const gchar *end = (const gchar *) payload->data + payload->len;
+    guint voice;
+
+    if (payload->len == sizeof (DaemonVoices) || end[-1] != 0)
+        return header->count == 0;
+
+    daemon_voices = g_new0 (espeak_VOICE, header->count);
+    daemon_voice_list = g_new0 (const espeak_VOICE *, header->count + 1);
+
+    for (voice = 0; voice < header->count && i < end; ++voice) {
+        espeak_VOICE *v = &daemon_voices[voice];
+
+        v->name = g_strdup (i);
+        i += strlen (i) + 1;
+
+        // espeak's list of priority byte and language pairs
+        gchar *languages = g_malloc0 (strlen (i) + 3);
+        languages[0] = 5;
+        strcpy (languages + 1, i);
+        v->languages = languages;
+        i += strlen (i) + 1;
+
+        v->identifier = g_strdup (i);
+        i += strlen (i) + 1;
+
+        daemon_voice_list[voice] = v;
+    }
+
+    return TRUE;
+}
+
+// returns daemon's sample rate or 0
+static gint connect_daemon () {
+    gchar *path = daemon_socket_path ();
+    struct sockaddr_un address = { AF_UNIX };
+    DaemonHeader header;
+
+    g_strlcpy (address.sun_path, path, sizeof (address.sun_path));
+    daemon_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (daemon_fd < 0 || connect (daemon_fd, (struct sockaddr *) &address,
+                    sizeof (address)) < 0) {
+        GST_WARNING ("cannot connect to %s: %s", path, g_strerror (errno));
+        disconnect ();
+        g_free (path);
+        return 0;
+    }
+
+    if (!daemon_send (daemon_fd, DAEMON_HELLO, NULL, 0, -1) ||
+            !daemon_receive (daemon_fd, &header, daemon_payload, NULL) ||
+            header.type != DAEMON_VOICES ||
+            (daemon_voice_list == NULL && !parse_voices (daemon_payload))) {
+        GST_WARNING ("no answer from %s", path);
+        disconnect ();
+        g_free (path);
+        return 0;
+    }
+
+    gint rate = ((DaemonVoices *) daemon_payload->data)->sample_rate;
+
+    GST_INFO ("connected to %s, rate=%d", path, rate);
+    g_free (path);
+
+    return rate;
+}
+
+static gint daemon_initialize (gint buffer_ms) {
+    daemon_payload = g_byte_array_new ();
+    daemon_events = g_array_new (FALSE, FALSE, sizeof (espeak_EVENT));
+    daemon_buffer_ms = buffer_ms;
+    daemon_sample_rate = connect_daemon ();
+
+    return daemon_sample_rate;
+}
+
+// in-process engine at the rate of the daemon
+static gboolean local_available () {
+    static gint local_rate = -1;
+
+    if (local_rate < 0)
+        local_rate = espeak_ng_backend.initialize (daemon_buffer_ms);
+
+    if (local_rate != daemon_sample_rate) {
+        GST_ERROR ("daemon is not available and %s runs at another rate",
+                espeak_ng_backend.name);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// the daemon has gone away and cannot be reconnected
+static gboolean fall_back () {
+    if (!local_available ())
+        return FALSE;
+
+    GST_WARNING ("daemon is not available, fall back to %s",
+            espeak_ng_backend.name);
+    espeak_ng_backend.set_callback (daemon_callback);
+    daemon_local = TRUE;
+
+    return TRUE;
+}
+
+static void local_synth (const gchar * text, gsize size, guint flags,
+        gpointer user_data) {
+    espeak_ng_backend.set_parameter (espeakPITCH, daemon_pitch);
+    espeak_ng_backend.set_parameter (espeakRATE, daemon_rate);
+    if (daemon_voice)
+        espeak_ng_backend.set_voice (daemon_voice);
+    espeak_ng_backend.set_parameter (espeakWORDGAP, daemon_gap);
+    espeak_ng_backend.synth (text, size, flags, user_data);
+}
+
+// drops sound and events of the resumed utterance which the daemon has
+// delivered already, the engine renders the same samples for it
+static gint resume_cb (short *data, int numsamples, espeak_EVENT * events) {
+    if (data && daemon_resumed < daemon_delivered) {
+        gsize skip = MIN (daemon_delivered - daemon_resumed,
+                (gsize) numsamples);
+        espeak_EVENT *i, *kept = events;
+
+        for (i = events; i->type != espeakEVENT_LIST_TERMINATED; ++i)
+            if ((gsize) i->sample >= daemon_delivered)
+                *kept++ = *i;
+        *kept = *i;
+
+        daemon_resumed += skip;
+        data += skip;
+        numsamples -= skip;
+    }
+
+    return daemon_callback (data, numsamples, events);
+}
+
+// the daemon went away in the middle of an utterance, synthesize the rest
+// of it in process; later ones try to reconnect first
+static void resume_local (const gchar * text, gsize size, guint flags,
+        gpointer user_data) {
+    if (daemon_aborted || !local_available ())
+        return;
+
+    GST_WARNING ("resume utterance in %s after %" G_GSIZE_FORMAT " samples",
+            espeak_ng_backend.name, daemon_delivered);
+
+    daemon_resumed = 0;
+    espeak_ng_backend.set_callback (resume_cb);
+    local_synth (text, size, flags, user_data);
+    espeak_ng_backend.set_callback (daemon_callback);
+}
+
+static void daemon_set_callback (t_espeak_callback * callback) {
+    daemon_callback = callback;
+}
+
+static const espeak_VOICE **daemon_list_voices () {
+    static const espeak_VOICE *none[] = { NULL };
+    return daemon_voice_list ? daemon_voice_list : none;
+}
+
+// the daemon is shared, so parameters go along with every request
+static void daemon_set_parameter (espeak_PARAMETER parameter, gint value) {
+    switch (parameter) {
+    case espeakPITCH:
+        daemon_pitch = value;
+        break;
+    case espeakRATE:
+        daemon_rate = value;
+        break;
+    case espeakWORDGAP:
+        daemon_gap = value;
+        break;
+    default:
+        break;
+    }
+}
+
+static void daemon_set_voice (const gchar * voice) {
+    if (g_strcmp0 (voice, daemon_voice) == 0)
+        return;
+    g_free (daemon_voice);
+    daemon_voice = g_strdup (voice);
+}
+
+static gboolean map_sound (gint fd, gsize size) {
+    if (daemon_sound)
+        munmap (daemon_sound, daemon_sound_size);
+
+    daemon_sound = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    daemon_sound_size = size;
+    close (fd);
+
+    if (daemon_sound == MAP_FAILED) {
+        daemon_sound = NULL;
+        daemon_sound_size = 0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// replay callbacks of the daemon's engine
+static gboolean replay_chunk (gint fd, gpointer user_data) {
+    DaemonChunk *chunk = (DaemonChunk *) daemon_payload->data;
+    const guint8 *i = daemon_payload->data + sizeof (DaemonChunk);
+    const guint8 *end = daemon_payload->data + daemon_payload->len;
+    guint event;
+
+    if (daemon_payload->len < sizeof (DaemonChunk))
+        return FALSE;
+
+    if (chunk->flags & DAEMON_CHUNK_NEW_FD) {
+        if (fd < 0 || !map_sound (fd, chunk->fd_size))
+            return FALSE;
+    } else if (fd >= 0)
+        close (fd);
+
+    if (!(chunk->flags & DAEMON_CHUNK_NO_DATA) &&
+            chunk->samples * sizeof (short) > daemon_sound_size)
+        return FALSE;
+
+    g_array_set_size (daemon_events, 0);
+
+    for (event = 0; event < chunk->events; ++event) {
+        DaemonEvent wire;
+        espeak_EVENT e = { 0 };
+
+        if (i + sizeof (wire) > end)
+            return FALSE;
+        memcpy (&wire, i, sizeof (wire));
+        i += sizeof (wire);
+
+        e.type = wire.type;
+        e.length = wire.length;
+        e.sample = wire.sample;
+        e.audio_position = wire.audio_position;
+        e.text_position = wire.text_position;
+        e.user_data = user_data;
+
+        if (wire.name_len) {
+            if (i + wire.name_len > end || i[wire.name_len - 1] != 0)
+                return FALSE;
+            e.id.name = (const char *) i;
+            i += wire.name_len;
+        } else
+            e.id.number = wire.number;
+
+        g_array_append_val (daemon_events, e);
+    }
+
+    espeak_EVENT terminator = { espeakEVENT_LIST_TERMINATED };
+    terminator.user_data = user_data;
+    g_array_append_val (daemon_events, terminator);
+
+    DaemonAck ack;
+    ack.abort = daemon_callback (chunk->flags & DAEMON_CHUNK_NO_DATA ? NULL :
+            (short *) daemon_sound, chunk->samples,
+            (espeak_EVENT *) daemon_events->data);
+
+    if (!(chunk->flags & DAEMON_CHUNK_NO_DATA))
+        daemon_delivered += chunk->samples;
+    if (ack.abort)
+        daemon_aborted = TRUE;
+
+    return daemon_send (daemon_fd, DAEMON_ACK, &ack, sizeof (ack), -1);
+}
+
+static void daemon_synth (const gchar * text, gsize size, guint flags,
+        gpointer user_data) {
+    DaemonSynth request;
+    DaemonHeader header;
+    gint fd;
+
+    if (daemon_fd < 0 && !daemon_local &&
+            connect_daemon () != daemon_sample_rate) {
+        disconnect ();
+        if (!fall_back ())
+            return;
+    }
+
+    if (daemon_local) {
+        local_synth (text, size, flags, user_data);
+        return;
+    }
+
+    daemon_delivered = 0;
+    daemon_aborted = FALSE;
+
+    request.pitch = daemon_pitch;
+    request.rate = daemon_rate;
+    request.gap = daemon_gap;
+    request.flags = flags;
+    request.voice_len = daemon_voice ? strlen (daemon_voice) : 0;
+    request.text_len = strnlen (text, size);
+
+    g_byte_array_set_size (daemon_payload, 0);
+    g_byte_array_append (daemon_payload, (const guint8 *) &request,
+            sizeof (request));
+    g_byte_array_append (daemon_payload, (const guint8 *) daemon_voice,
+            request.voice_len);
+    g_byte_array_append (daemon_payload, (const guint8 *) text,
+            request.text_len);
+
+    if (!daemon_send (daemon_fd, DAEMON_SYNTH, daemon_payload->data,
+                    daemon_payload->len, -1)) {
+        GST_WARNING ("lost connection to the daemon");
+        disconnect ();
+        resume_local (text, size, flags, user_data);
+        return;
+    }
+
+    for (;;) {
+        if (!daemon_receive (daemon_fd, &header, daemon_payload, &fd)) {
+            GST_WARNING ("lost connection to the daemon");
+            disconnect ();
+            resume_local (text, size, flags, user_data);
+            return;
+        }
+        if (header.type == DAEMON_DONE)
+            break;
+        if (header.type != DAEMON_CHUNK || !replay_chunk (fd, user_data)) {
+            GST_WARNING ("protocol error");
+            disconnect ();
+            resume_local (text, size, flags, user_data);
+            return;
+        }
+    }
+}
+
+const Ebackend daemon_backend = {
+    "daemon",
+    daemon_initialize,
+    daemon_set_callback,
+    daemon_list_voices,
+    daemon_set_parameter,
+    daemon_set_voice,
+    daemon_synth
+};
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/* Protocol between the "daemon" backend and espeak-daemon.
+ *
+ * Every message is a DaemonHeader followed by size bytes of payload, in
+ * host byte order since both ends run on the same host. Sound is not
+ * sent through the socket, the daemon passes a memfd with SCM_RIGHTS
+ * along with the first chunk (and again whenever it has to grow) and
+ * writes every chunk at the start of it. The client acknowledges every
+ * chunk with the value its synth callback returned, so the daemon does
+ * not overwrite sound which is still read and synthesis can be aborted.
+ *
+ *   client                     daemon
+ *   HELLO              ->
+ *                      <-      VOICES (sample rate, voices)
+ *   SYNTH              ->
+ *                      <-      CHUNK (events, sound in memfd)
+ *   ACK                ->
+ *                      ...
+ *                      <-      DONE
+ */
+
+#define DAEMON_SOCKET_NAME "gst-espeak.sock"
+
+typedef enum {
+    DAEMON_HELLO = 1,
+    DAEMON_VOICES,
+    DAEMON_SYNTH,
+    DAEMON_CHUNK,
+    DAEMON_ACK,
+    DAEMON_DONE
+} DaemonMessage;
+
+typedef struct {
+    guint32 type;
+    guint32 size;
+} DaemonHeader;
+
+/* VOICES payload is the sample rate followed by count voices, each of
+ * them is three 0-terminated strings (name, language, identifier) */
+typedef struct {
+    gint32 sample_rate;
+    guint32 count;
+} DaemonVoices;
+
+/* SYNTH payload is followed by voice_len bytes of voice name and
+ * text_len bytes of text */
+typedef struct {
+    gint32 pitch;
+    gint32 rate;
+    gint32 gap;
+    guint32 flags;
+    guint32 voice_len;
+    guint32 text_len;
+} DaemonSynth;
+
+#define DAEMON_CHUNK_NO_DATA 1
+#define DAEMON_CHUNK_NEW_FD 2
+
+/* CHUNK payload is followed by events, every DaemonEvent is followed by
+ * name_len bytes of mark name */
+typedef struct {
+    guint32 flags;
+    gint32 samples;
+    guint32 events;
+    guint32 fd_size;
+} DaemonChunk;
+
+typedef struct {
+    gint32 type;
+    gint32 length;
+    gint32 sample;
+    gint32 audio_position;
+    gint32 text_position;
+    gint32 number;
+    guint32 name_len;
+} DaemonEvent;
+
+typedef struct {
+    gint32 abort;
+} DaemonAck;
+
+gchar *daemon_socket_path ();
+gboolean daemon_send (gint fd, DaemonMessage type, gconstpointer data,
+        gsize size, gint pass_fd);
+gboolean daemon_receive (gint fd, DaemonHeader * header, GByteArray * payload,
+        gint * passed_fd);
+
+#endif
@@ -0,0 +1,450 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Benchmark harness for the espeak element.
+ *
+ * Drives one or more "espeak ! appsink" pipelines and prints one JSON
+ * object per scenario and concurrency level on stdout, e.g.
+ *
+ *   GST_PLUGIN_PATH=.libs ./espeak-bench --streams 4
+ *
+ * Run with GST_ESPEAK_BACKEND=fake to measure the element without the
+ * cost of espeak-ng itself.
+ *
+ * Allocations made by streaming threads once the first buffers went
+ * through are reported as steady_allocs_per_buffer, --max-steady-allocs
+ * turns exceeding it into a failure. Every event message has to be posted
+ * right before the buffer which ends where the event starts, otherwise the
+ * run fails.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+
+#include "espeak.h"
+
+// allocations -----------------------------------------------------------------
+
+#ifdef __GLIBC__
+// the executable interposes the allocator for every loaded library,
+// including the plugin itself
+extern void *__libc_malloc (size_t);
+extern void *__libc_calloc (size_t, size_t);
+extern void *__libc_realloc (void *, size_t);
+extern void *__libc_memalign (size_t, size_t);
+
+static volatile gint allocations = 0;
+static __thread gint thread_allocations = 0;
+
+void *malloc (size_t size) {
+    g_atomic_int_inc (&allocations);
+    ++thread_allocations;
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size) {
+    g_atomic_int_inc (&allocations);
+    ++thread_allocations;
+    return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size) {
+    g_atomic_int_inc (&allocations);
+    ++thread_allocations;
+    return __libc_realloc (ptr, size);
+}
+
+// GstAllocator takes aligned memory, count it as well
+void *memalign (size_t alignment, size_t size) {
+    g_atomic_int_inc (&allocations);
+    ++thread_allocations;
+    return __libc_memalign (alignment, size);
+}
+
+void *aligned_alloc (size_t alignment, size_t size) {
+    return memalign (alignment, size);
+}
+
+int posix_memalign (void **ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof (void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+
+    void *result = memalign (alignment, size);
+    if (result == NULL)
+        return ENOMEM;
+
+    *ptr = result;
+    return 0;
+}
+
+#define ALLOCATIONS() g_atomic_int_get (&allocations)
+#define THREAD_ALLOCATIONS() thread_allocations
+#else
+#define ALLOCATIONS() 0
+#define THREAD_ALLOCATIONS() 0
+#endif
+
+// buffers to let pools and queues grow before counting steady allocations
+#define WARMUP_BUFFERS 16
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+    const gchar *name;
+    guint track;
+    gchar *text;
+} Scenario;
+
+typedef struct {
+    GstElement *pipeline;
+    GstElement *sink;
+    GstClockTime started;
+    GstClockTime first_buffer;
+    guint64 bytes;
+    guint64 buffers;
+    gint rate;
+    // streaming thread allocations after WARMUP_BUFFERS
+    guint64 pushed;
+    gint thread_allocations;
+    guint64 steady_allocs;
+    guint64 steady_buffers;
+    // start of the last event, the next buffer has to end there
+    GstClockTime event_time;
+    guint64 events;
+    guint64 misplaced_events;
+} Stream;
+
+static gint opt_streams = 4;
+static gint opt_iterations = 3;
+static gchar *opt_scenario = NULL;
+static gchar *opt_voice = NULL;
+static gdouble opt_max_steady_allocs = -1;
+static gboolean failed = FALSE;
+
+static GOptionEntry options[] = {
+    {"streams", 'j', 0, G_OPTION_ARG_INT, &opt_streams,
+            "Maximum number of concurrent elements", "N"},
+    {"iterations", 'n', 0, G_OPTION_ARG_INT, &opt_iterations,
+            "Runs per scenario and concurrency level", "N"},
+    {"scenario", 's', 0, G_OPTION_ARG_STRING, &opt_scenario,
+            "Run only this scenario (short, long, word, mark)", "NAME"},
+    {"voice", 'v', 0, G_OPTION_ARG_STRING, &opt_voice,
+            "Voice to use", "VOICE"},
+    {"max-steady-allocs", 0, 0, G_OPTION_ARG_DOUBLE, &opt_max_steady_allocs,
+            "Fail if streaming threads allocate more per buffer", "N"},
+    {NULL}
+};
+
+static const gchar *paragraph =
+        "The quick brown fox jumps over the lazy dog. "
+        "Speech synthesis converts written text into audible speech, "
+        "one word after another, at a configurable rate and pitch. ";
+
+static inline GstClockTime monotonic_time () {
+    return g_get_monotonic_time () * GST_USECOND;
+}
+
+static gchar *long_text () {
+    GString *text = g_string_new (NULL);
+    gint i;
+
+    for (i = 0; i < 40; ++i)
+        g_string_append (text, paragraph);
+
+    return g_string_free (text, FALSE);
+}
+
+static gchar *mark_text () {
+    GString *text = g_string_new ("<speak>");
+    gint i;
+
+    for (i = 0; i < 40; ++i)
+        g_string_append_printf (text, "<mark name=\"m%d\"/>%s", i, paragraph);
+    g_string_append (text, "</speak>");
+
+    return g_string_free (text, FALSE);
+}
+
+// runs in the streaming thread between two espeak_out() calls
+static GstPadProbeReturn count_allocations (GstPad * pad,
+        GstPadProbeInfo * info, gpointer data) {
+    Stream *stream = (Stream *) data;
+    gint thread_allocations = THREAD_ALLOCATIONS ();
+
+    if (stream->pushed++ >= WARMUP_BUFFERS) {
+        stream->steady_allocs +=
+                thread_allocations - stream->thread_allocations;
+        stream->steady_buffers += 1;
+    }
+    stream->thread_allocations = thread_allocations;
+
+    return GST_PAD_PROBE_OK;
+}
+
+// events are posted right before the buffer which ends where they start
+static GstPadProbeReturn check_events (GstPad * pad, GstPadProbeInfo * info,
+        gpointer data) {
+    Stream *stream = (Stream *) data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER (info);
+
+    if (GST_CLOCK_TIME_IS_VALID (stream->event_time) &&
+            GST_BUFFER_TIMESTAMP (buf) + GST_BUFFER_DURATION (buf) !=
+            stream->event_time)
+        stream->misplaced_events += 1;
+    stream->event_time = GST_CLOCK_TIME_NONE;
+
+    return GST_PAD_PROBE_OK;
+}
+
+// consume messages like an application would, so they don't pile up, and
+// remember where events start; runs in the streaming thread
+static GstBusSyncReply drop_message (GstBus * bus, GstMessage * message,
+        gpointer data) {
+    Stream *stream = (Stream *) data;
+    const GstStructure *event = gst_message_get_structure (message);
+    guint64 time;
+
+    if (GST_MESSAGE_TYPE (message) != GST_MESSAGE_ELEMENT)
+        return GST_BUS_PASS;
+
+    if (event && gst_structure_get_uint64 (event, "time", &time)) {
+        if (GST_CLOCK_TIME_IS_VALID (stream->event_time) &&
+                stream->event_time != time)
+            stream->misplaced_events += 1;
+        stream->event_time = time;
+        stream->events += 1;
+    }
+
+    gst_message_unref (message);
+    return GST_BUS_DROP;
+}
+
+static gboolean stream_new (Stream * stream, Scenario * scenario) {
+    GError *error = NULL;
+
+    memset (stream, 0, sizeof (Stream));
+    stream->event_time = GST_CLOCK_TIME_NONE;
+
+    stream->pipeline = gst_parse_launch ("espeak name=src ! "
+            "appsink name=sink sync=false", &error);
+    if (!stream->pipeline) {
+        g_printerr ("Cannot create pipeline: %s\n", error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    GstElement *src = gst_bin_get_by_name (GST_BIN (stream->pipeline), "src");
+    g_object_set (src, "text", scenario->text, "track", scenario->track, NULL);
+    if (opt_voice)
+        g_object_set (src, "voice", opt_voice, NULL);
+
+    GstPad *pad = gst_element_get_static_pad (src, "src");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, count_allocations,
+            stream, NULL);
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, check_events,
+            stream, NULL);
+    gst_object_unref (pad);
+    gst_object_unref (src);
+
+    GstBus *bus = gst_element_get_bus (stream->pipeline);
+    gst_bus_set_sync_handler (bus, drop_message, stream, NULL);
+    gst_object_unref (bus);
+
+    stream->sink = gst_bin_get_by_name (GST_BIN (stream->pipeline), "sink");
+    // stay in READY so synthesis starts only once the run is timed
+    gst_element_set_state (stream->pipeline, GST_STATE_READY);
+
+    return TRUE;
+}
+
+static void stream_free (Stream * stream) {
+    gst_element_set_state (stream->pipeline, GST_STATE_NULL);
+    gst_object_unref (stream->sink);
+    gst_object_unref (stream->pipeline);
+}
+
+static gpointer stream_run (gpointer data) {
+    Stream *stream = (Stream *) data;
+    GstSample *sample;
+
+    while ((sample = gst_app_sink_pull_sample (GST_APP_SINK (stream->sink)))) {
+        if (!stream->buffers) {
+            GstStructure *caps =
+                    gst_caps_get_structure (gst_sample_get_caps (sample), 0);
+            stream->first_buffer = monotonic_time () - stream->started;
+            gst_structure_get_int (caps, "rate", &stream->rate);
+        }
+        stream->buffers += 1;
+        stream->bytes += gst_buffer_get_size (gst_sample_get_buffer (sample));
+        gst_sample_unref (sample);
+    }
+
+    return NULL;
+}
+
+static void run (Scenario * scenario, gint streams) {
+    Stream *stream = g_new0 (Stream, streams);
+    GThread **threads = g_new0 (GThread *, streams);
+    GstClockTime first_buffer = 0;
+    GstClockTime first_buffer_max = 0;
+    GstClockTime wall = 0;
+    gdouble audio = 0;
+    guint64 buffers = 0;
+    gint64 allocs = 0;
+    guint64 steady_allocs = 0;
+    guint64 steady_buffers = 0;
+    guint64 events = 0;
+    guint64 misplaced_events = 0;
+    gdouble cpu = 0;
+    gint iteration, i;
+
+    for (iteration = 0; iteration < opt_iterations; ++iteration) {
+        for (i = 0; i < streams; ++i)
+            if (!stream_new (&stream[i], scenario))
+                exit (1);
+
+        struct rusage usage_start, usage_end;
+        getrusage (RUSAGE_SELF, &usage_start);
+        gint allocs_start = ALLOCATIONS ();
+        GstClockTime start = monotonic_time ();
+
+        for (i = 0; i < streams; ++i) {
+            stream[i].started = monotonic_time ();
+            gst_element_set_state (stream[i].pipeline, GST_STATE_PLAYING);
+            threads[i] = g_thread_create (stream_run, &stream[i], TRUE, NULL);
+        }
+        for (i = 0; i < streams; ++i)
+            g_thread_join (threads[i]);
+
+        wall += monotonic_time () - start;
+        allocs += ALLOCATIONS () - allocs_start;
+        getrusage (RUSAGE_SELF, &usage_end);
+        cpu += (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+                (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+                (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec +
+                usage_end.ru_stime.tv_usec -
+                usage_start.ru_stime.tv_usec) / 1e6;
+
+        for (i = 0; i < streams; ++i) {
+            first_buffer += stream[i].first_buffer;
+            first_buffer_max = MAX (first_buffer_max, stream[i].first_buffer);
+            buffers += stream[i].buffers;
+            steady_allocs += stream[i].steady_allocs;
+            steady_buffers += stream[i].steady_buffers;
+            events += stream[i].events;
+            misplaced_events += stream[i].misplaced_events;
+            if (stream[i].rate)
+                audio += (gdouble) stream[i].bytes / 2 / stream[i].rate;
+            stream_free (&stream[i]);
+        }
+    }
+
+    gdouble wall_sec = (gdouble) wall / GST_SECOND;
+    gint runs = opt_iterations * streams;
+    gdouble steady = steady_buffers ?
+            (gdouble) steady_allocs / steady_buffers : 0;
+
+    g_print ("{\"scenario\": \"%s\", \"streams\": %d, \"iterations\": %d, "
+            "\"time_to_first_buffer_ms\": %.3f, "
+            "\"time_to_first_buffer_max_ms\": %.3f, "
+            "\"realtime_factor\": %.3f, "
+            "\"audio_sec\": %.3f, \"wall_sec\": %.3f, \"buffers\": %"
+            G_GUINT64_FORMAT ", "
+            "\"allocs_per_sec\": %.1f, \"allocs_per_audio_sec\": %.1f, "
+            "\"allocs_per_buffer\": %.2f, "
+            "\"steady_allocs_per_buffer\": %.3f, "
+            "\"events\": %" G_GUINT64_FORMAT ", "
+            "\"misplaced_events\": %" G_GUINT64_FORMAT ", "
+            "\"cpu_per_stream_ms\": %.3f}\n",
+            scenario->name, streams, opt_iterations,
+            (gdouble) first_buffer / runs / GST_MSECOND,
+            (gdouble) first_buffer_max / GST_MSECOND,
+            wall_sec > 0 ? audio / wall_sec : 0,
+            audio, wall_sec, buffers,
+            wall_sec > 0 ? allocs / wall_sec : 0,
+            audio > 0 ? allocs / audio : 0,
+            buffers ? (gdouble) allocs / buffers : 0,
+            steady, events, misplaced_events, cpu * 1000 / runs);
+
+    if (opt_max_steady_allocs >= 0 && steady > opt_max_steady_allocs) {
+        g_printerr ("%s: %.3f allocations per buffer in steady state, "
+                "expected at most %.3f\n", scenario->name, steady,
+                opt_max_steady_allocs);
+        failed = TRUE;
+    }
+
+    if (misplaced_events) {
+        g_printerr ("%s: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+                " events were not posted right before the buffer ending "
+                "at them\n", scenario->name, misplaced_events, events);
+        failed = TRUE;
+    }
+
+    g_free (threads);
+    g_free (stream);
+}
+
+int main (int argc, char **argv) {
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new ("- espeak benchmark");
+
+    g_option_context_add_main_entries (context, options, NULL);
+    g_option_context_add_group (context, gst_init_get_option_group ());
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (!gst_element_factory_find ("espeak")) {
+        g_printerr ("espeak element is not available, check GST_PLUGIN_PATH\n");
+        return 1;
+    }
+
+    Scenario scenarios[] = {
+        {"short", ESPEAK_TRACK_NONE, g_strdup ("Hello world.")},
+        {"long", ESPEAK_TRACK_NONE, long_text ()},
+        {"word", ESPEAK_TRACK_WORD, long_text ()},
+        {"mark", ESPEAK_TRACK_MARK, mark_text ()},
+    };
+    guint i;
+    gint streams;
+
+    for (i = 0; i < G_N_ELEMENTS (scenarios); ++i) {
+        if (!opt_scenario || strcmp (opt_scenario, scenarios[i].name) == 0)
+            for (streams = 1;; streams = MIN (streams * 2, opt_streams)) {
+                run (&scenarios[i], streams);
+                if (streams >= opt_streams)
+                    break;
+            }
+        g_free (scenarios[i].text);
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Host-wide synthesis daemon for the "daemon" backend, see daemon.h for
+ * the protocol. The engine and preloaded voices are loaded once, every
+ * client is served by a forked process which shares them copy-on-write,
+ * so a slow client never holds up the others, e.g.
+ *
+ *   espeak-daemon --preload en,de &
+ *   GST_ESPEAK_BACKEND=daemon gst-launch-1.0 espeak text=Hello ! ...
+ *
+ * GST_ESPEAK_BACKEND=fake makes the daemon itself use the fake engine.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "backend.h"
+#include "daemon.h"
+
+#define DAEMON_BUFFER_MS 200
+// clients which don't acknowledge a chunk in time are dropped
+#define DAEMON_ACK_TIMEOUT_MS 2000
+
+typedef struct {
+    gint fd;
+
+    // sound of the current chunk, shared with the client
+    gint sound_fd;
+    guint8 *sound;
+    gsize sound_size;
+
+    GByteArray *payload;
+    GByteArray *chunk;
+    gboolean failed;
+} Client;
+
+static const Ebackend *backend = NULL;
+static gchar *current_voice = NULL;
+static GByteArray *voices = NULL;
+
+static gchar *opt_socket = NULL;
+static gchar *opt_preload = NULL;
+
+static GOptionEntry options[] = {
+    {"socket", 's', 0, G_OPTION_ARG_FILENAME, &opt_socket,
+            "Socket to listen on (default: $GST_ESPEAK_DAEMON or "
+            "gst-espeak.sock in the runtime directory)", "PATH"},
+    {"preload", 'p', 0, G_OPTION_ARG_STRING, &opt_preload,
+            "Comma separated voices to load on start", "VOICES"},
+    {NULL}
+};
+
+// engine ----------------------------------------------------------------------
+
+static gint new_sound_fd () {
+#ifdef HAVE_MEMFD_CREATE
+    return memfd_create ("gst-espeak", MFD_CLOEXEC);
+#else
+    gchar *path = NULL;
+    gint fd = g_file_open_tmp ("gst-espeak-XXXXXX", &path, NULL);
+
+    if (path) {
+        unlink (path);
+        g_free (path);
+    }
+    return fd;
+#endif
+}
+
+static gboolean grow_sound (Client * client, gsize size) {
+    if (client->sound)
+        munmap (client->sound, client->sound_size);
+    if (client->sound_fd >= 0)
+        close (client->sound_fd);
+
+    client->sound = NULL;
+    client->sound_size = 0;
+    client->sound_fd = new_sound_fd ();
+
+    if (client->sound_fd < 0 || ftruncate (client->sound_fd, size) < 0)
+        return FALSE;
+
+    client->sound = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            client->sound_fd, 0);
+    if (client->sound == MAP_FAILED) {
+        client->sound = NULL;
+        return FALSE;
+    }
+
+    client->sound_size = size;
+    return TRUE;
+}
+
+// forward every callback of the engine to the client and wait for its
+// answer, so the sound buffer can be reused for the next chunk
+static gint synth_cb (short *data, int numsamples, espeak_EVENT * events) {
+    Client *client = events->user_data;
+    espeak_EVENT *i;
+
+    // warming up, see preload ()
+    if (client == NULL)
+        return 0;
+    if (client->failed)
+        return 1;
+
+    DaemonChunk chunk = { 0 };
+    gsize bytes = MAX (numsamples, 0) * sizeof (short);
+    gint pass_fd = -1;
+
+    chunk.samples = numsamples;
+    if (data == NULL)
+        chunk.flags |= DAEMON_CHUNK_NO_DATA;
+    else if (bytes > client->sound_size) {
+        if (!grow_sound (client, MAX (bytes, client->sound_size * 2))) {
+            g_warning ("cannot allocate shared memory: %s",
+                    g_strerror (errno));
+            client->failed = TRUE;
+            return 1;
+        }
+        chunk.flags |= DAEMON_CHUNK_NEW_FD;
+        chunk.fd_size = client->sound_size;
+        pass_fd = client->sound_fd;
+    }
+
+    if (data)
+        memcpy (client->sound, data, bytes);
+
+    g_byte_array_set_size (client->chunk, sizeof (DaemonChunk));
+
+    for (i = events; i->type != espeakEVENT_LIST_TERMINATED; ++i) {
+        DaemonEvent wire = { 0 };
+
+        wire.type = i->type;
+        wire.length = i->length;
+        wire.sample = i->sample;
+        wire.audio_position = i->audio_position;
+        wire.text_position = i->text_position;
+
+        if ((i->type == espeakEVENT_MARK || i->type == espeakEVENT_PLAY) &&
+                i->id.name)
+            wire.name_len = strlen (i->id.name) + 1;
+        else
+            wire.number = i->id.number;
+
+        g_byte_array_append (client->chunk, (const guint8 *) &wire,
+                sizeof (wire));
+        if (wire.name_len)
+            g_byte_array_append (client->chunk, (const guint8 *) i->id.name,
+                    wire.name_len);
+        chunk.events += 1;
+    }
+
+    memcpy (client->chunk->data, &chunk, sizeof (chunk));
+
+    DaemonHeader header;
+    struct pollfd ack = { client->fd, POLLIN };
+
+    if (!daemon_send (client->fd, DAEMON_CHUNK, client->chunk->data,
+                    client->chunk->len, pass_fd) ||
+            poll (&ack, 1, DAEMON_ACK_TIMEOUT_MS) != 1 ||
+            !daemon_receive (client->fd, &header, client->payload, NULL) ||
+            header.type != DAEMON_ACK ||
+            client->payload->len < sizeof (DaemonAck)) {
+        client->failed = TRUE;
+        return 1;
+    }
+
+    return ((DaemonAck *) client->payload->data)->abort;
+}
+
+static void set_voice (const gchar * voice) {
+    if (g_strcmp0 (voice, current_voice) == 0)
+        return;
+
+    backend->set_voice (voice);
+    g_free (current_voice);
+    current_voice = g_strdup (voice);
+}
+
+static void preload (const gchar * names) {
+    static const gchar warm_up[] = "Hello.";
+    gchar **list = g_strsplit (names, ",", -1);
+    gchar **i;
+
+    for (i = list; *i; ++i) {
+        gchar *name = g_strstrip (*i);
+        if (*name == 0)
+            continue;
+        set_voice (name);
+        backend->synth (warm_up, sizeof (warm_up), espeakCHARS_UTF8, NULL);
+    }
+
+    g_strfreev (list);
+}
+
+static void build_voices (gint sample_rate) {
+    const espeak_VOICE **list = backend->list_voices ();
+    const espeak_VOICE **i;
+    DaemonVoices header = { sample_rate, 0 };
+
+    voices = g_byte_array_new ();
+    g_byte_array_append (voices, (const guint8 *) &header, sizeof (header));
+
+    for (i = list; *i; ++i) {
+        const gchar *language = (*i)->languages ? (*i)->languages + 1 : "";
+        const gchar *identifier = (*i)->identifier ? (*i)->identifier : "";
+
+        g_byte_array_append (voices, (const guint8 *) (*i)->name,
+                strlen ((*i)->name) + 1);
+        g_byte_array_append (voices, (const guint8 *) language,
+                strlen (language) + 1);
+        g_byte_array_append (voices, (const guint8 *) identifier,
+                strlen (identifier) + 1);
+        header.count += 1;
+    }
+
+    memcpy (voices->data, &header, sizeof (header));
+}
+
+// clients ---------------------------------------------------------------------
+
+static void synth (Client * client) {
+    if (client->payload->len < sizeof (DaemonSynth))
+        return;
+
+    DaemonSynth request;
+    memcpy (&request, client->payload->data, sizeof (request));
+
+    if (sizeof (request) + request.voice_len + request.text_len >
+            client->payload->len)
+        return;
+
+    gchar *voice = g_strndup ((const gchar *) client->payload->data +
+            sizeof (request), request.voice_len);
+    gchar *text = g_strndup ((const gchar *) client->payload->data +
+            sizeof (request) + request.voice_len, request.text_len);
+
+    backend->set_parameter (espeakPITCH, request.pitch);
+    backend->set_parameter (espeakRATE, request.rate);
+    if (*voice)
+        set_voice (voice);
+    backend->set_parameter (espeakWORDGAP, request.gap);
+    backend->synth (text, request.text_len + 1, request.flags, client);
+
+    if (client->failed)
+        g_warning ("client does not answer, drop it");
+
+    g_free (text);
+    g_free (voice);
+}
+
+static void serve (gint fd) {
+    Client *client = g_new0 (Client, 1);
+    DaemonHeader header;
+
+    client->fd = fd;
+    client->sound_fd = -1;
+    client->payload = g_byte_array_new ();
+    client->chunk = g_byte_array_new ();
+
+    while (!client->failed &&
+            daemon_receive (client->fd, &header, client->payload, NULL)) {
+        switch (header.type) {
+        case DAEMON_HELLO:
+            client->failed = !daemon_send (client->fd, DAEMON_VOICES,
+                    voices->data, voices->len, -1);
+            break;
+        case DAEMON_SYNTH:
+            synth (client);
+            if (!client->failed)
+                client->failed = !daemon_send (client->fd, DAEMON_DONE,
+                        NULL, 0, -1);
+            break;
+        default:
+            g_warning ("unexpected message %d", header.type);
+            client->failed = TRUE;
+            break;
+        }
+    }
+
+    close (client->fd);
+    if (client->sound)
+        munmap (client->sound, client->sound_size);
+    if (client->sound_fd >= 0)
+        close (client->sound_fd);
+    g_byte_array_free (client->payload, TRUE);
+    g_byte_array_free (client->chunk, TRUE);
+    g_free (client);
+}
+
+// -----------------------------------------------------------------------------
+
+int main (int argc, char **argv) {
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new ("- espeak synthesis "
+            "daemon");
+
+    g_option_context_add_main_entries (context, options, NULL);
+    g_option_context_add_group (context, gst_init_get_option_group ());
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    backend = g_strcmp0 (g_getenv ("GST_ESPEAK_BACKEND"), "fake") == 0 ?
+            &fake_backend : &espeak_ng_backend;
+
+    gint sample_rate = backend->initialize (DAEMON_BUFFER_MS);
+    if (sample_rate <= 0) {
+        g_printerr ("Cannot initialize %s engine\n", backend->name);
+        return 1;
+    }
+    backend->set_callback (synth_cb);
+    build_voices (sample_rate);
+
+    if (opt_preload)
+        preload (opt_preload);
+
+    gchar *path = opt_socket ? opt_socket : daemon_socket_path ();
+    struct sockaddr_un address = { AF_UNIX };
+    gint fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    g_strlcpy (address.sun_path, path, sizeof (address.sun_path));
+    unlink (path);
+
+    if (fd < 0 || bind (fd, (struct sockaddr *) &address,
+                    sizeof (address)) < 0 || listen (fd, 64) < 0) {
+        g_printerr ("Cannot listen on %s: %s\n", path, g_strerror (errno));
+        return 1;
+    }
+
+    g_print ("%s engine listening on %s\n", backend->name, path);
+
+    // clients are served by children, don't wait for them
+    signal (SIGCHLD, SIG_IGN);
+
+    for (;;) {
+        gint client_fd = accept4 (fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (client_fd < 0) {
+            if (errno != EINTR)
+                g_warning ("accept: %s", g_strerror (errno));
+            continue;
+        }
+
+        pid_t pid = fork ();
+
+        if (pid == 0) {
+            close (fd);
+            serve (client_fd);
+            _exit (0);
+        }
+
+        if (pid < 0)
+            g_warning ("fork: %s", g_strerror (errno));
+        close (client_fd);
+    }
+
+    return 0;
+}
@@ -0,0 +1,499 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Batch renderer for prompt libraries.
+ *
+ * Reads a manifest of tab separated lines
+ *
+ *   text <TAB> voice <TAB> rate <TAB> pitch <TAB> output.wav [<TAB> track]
+ *
+ * (empty voice, rate or pitch mean defaults, track is "word" or "mark" for
+ * SSML text and defaults to --track, lines starting with '#' are ignored)
+ * and renders every item to a WAV file with an "output.wav.timing"
+ * sidecar of tab separated "word|sentence|mark, seconds, offset, length or
+ * mark name" lines.
+ *
+ * There is only one espeak engine per process, so items are rendered by
+ * --jobs worker processes, each keeps its engine, voices and pipeline
+ * warm for all items it takes. One JSON object per item and a final
+ * summary are printed on stdout.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "espeak.h"
+
+typedef struct {
+    gchar *text;
+    gchar *voice;
+    gint rate;
+    gint pitch;
+    gchar *output;
+    guint track;
+} Item;
+
+// per item results, shared between worker processes
+typedef struct {
+    gint done;
+    gint failed;
+    gint worker;
+    gdouble audio_sec;
+    gdouble wall_sec;
+    gdouble cpu_sec;
+} Result;
+
+typedef struct {
+    volatile gint next;
+    Result results[];
+} Shared;
+
+typedef struct {
+    GstElement *pipeline;
+    GstElement *src;
+    GstElement *sink;
+    gint sample_rate;
+    guint64 samples;
+    GString *timing;
+} Renderer;
+
+static gint opt_jobs = 0;
+static gchar *opt_track = NULL;
+
+static GOptionEntry options[] = {
+    {"jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs,
+            "Number of worker processes (default: number of cores)", "N"},
+    {"track", 't', 0, G_OPTION_ARG_STRING, &opt_track,
+            "Track of items without one, word or mark (default: word)",
+            "TRACK"},
+    {NULL}
+};
+
+static inline GstClockTime monotonic_time () {
+    return g_get_monotonic_time () * GST_USECOND;
+}
+
+// manifest --------------------------------------------------------------------
+
+// returns ESPEAK_TRACK_* or -1
+static gint parse_track (const gchar * name) {
+    if (name == NULL || *name == 0 || strcmp (name, "word") == 0)
+        return ESPEAK_TRACK_WORD;
+    if (strcmp (name, "mark") == 0)
+        return ESPEAK_TRACK_MARK;
+    return -1;
+}
+
+static GArray *read_manifest (const gchar * path, gint track,
+        GError ** error) {
+    gchar *content;
+
+    if (!g_file_get_contents (path, &content, NULL, error))
+        return NULL;
+
+    GArray *items = g_array_new (FALSE, TRUE, sizeof (Item));
+    gchar **lines = g_strsplit (content, "\n", -1);
+    gchar **i;
+    gint line = 0;
+
+    for (i = lines; *i; ++i) {
+        ++line;
+        g_strchomp (*i);
+        if (**i == 0 || **i == '#')
+            continue;
+
+        gchar **fields = g_strsplit (*i, "\t", 6);
+        guint count = g_strv_length (fields);
+        gint item_track = count == 6 ? parse_track (fields[5]) : track;
+
+        if (count < 5 || *fields[0] == 0 || *fields[4] == 0) {
+            g_printerr ("%s:%d: expected text, voice, rate, pitch, output "
+                    "and optional track\n", path, line);
+            g_strfreev (fields);
+            continue;
+        }
+        if (item_track < 0) {
+            g_printerr ("%s:%d: unknown track %s\n", path, line, fields[5]);
+            g_strfreev (fields);
+            continue;
+        }
+
+        Item item;
+        item.text = g_strdup (fields[0]);
+        item.voice = *fields[1] ? g_strdup (fields[1]) : NULL;
+        item.rate = atoi (fields[2]);
+        item.pitch = atoi (fields[3]);
+        item.output = g_strdup (fields[4]);
+        item.track = item_track;
+        g_array_append_val (items, item);
+
+        g_strfreev (fields);
+    }
+
+    g_strfreev (lines);
+    g_free (content);
+
+    return items;
+}
+
+// let the plugin load every voice of the manifest once per worker
+static void preload_voices (GArray * items) {
+    if (g_getenv ("GST_ESPEAK_PRELOAD"))
+        return;
+
+    GHashTable *seen = g_hash_table_new (g_str_hash, g_str_equal);
+    GString *voices = g_string_new (NULL);
+    guint i;
+
+    for (i = 0; i < items->len; ++i) {
+        const gchar *voice = g_array_index (items, Item, i).voice;
+        if (voice == NULL || g_hash_table_lookup (seen, voice))
+            continue;
+        g_hash_table_insert (seen, (gpointer) voice, (gpointer) voice);
+        if (voices->len)
+            g_string_append_c (voices, ',');
+        g_string_append (voices, voice);
+    }
+
+    if (voices->len)
+        g_setenv ("GST_ESPEAK_PRELOAD", voices->str, TRUE);
+
+    g_string_free (voices, TRUE);
+    g_hash_table_destroy (seen);
+}
+
+// rendering -------------------------------------------------------------------
+
+static GstPadProbeReturn count_samples (GstPad * pad, GstPadProbeInfo * info,
+        gpointer data) {
+    Renderer *renderer = (Renderer *) data;
+
+    renderer->samples += gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info))
+            / 2;
+
+    return GST_PAD_PROBE_OK;
+}
+
+static GstBusSyncReply collect_timing (GstBus * bus, GstMessage * message,
+        gpointer data) {
+    Renderer *renderer = (Renderer *) data;
+    const GstStructure *event = gst_message_get_structure (message);
+
+    if (GST_MESSAGE_TYPE (message) != GST_MESSAGE_ELEMENT || event == NULL ||
+            !g_str_has_prefix (gst_structure_get_name (event), "espeak-"))
+        return GST_BUS_PASS;
+
+    const gchar *name = gst_structure_get_name (event) + 7;
+    guint offset = 0, len = 0;
+    guint64 time = 0;
+
+    // stream time the event starts at, posted by the element
+    if (!gst_structure_get_uint64 (event, "time", &time))
+        return GST_BUS_PASS;
+    gst_structure_get_uint (event, "offset", &offset);
+
+    if (strcmp (name, "word") == 0 || strcmp (name, "sentence") == 0) {
+        gst_structure_get_uint (event, "len", &len);
+        g_string_append_printf (renderer->timing, "%s\t%.3f\t%u\t%u\n",
+                name, (gdouble) time / GST_SECOND, offset, len);
+    } else if (strcmp (name, "mark") == 0) {
+        g_string_append_printf (renderer->timing, "%s\t%.3f\t%u\t%s\n",
+                name, (gdouble) time / GST_SECOND, offset,
+                gst_structure_get_string (event, "mark"));
+    } else
+        return GST_BUS_PASS;
+
+    gst_message_unref (message);
+    return GST_BUS_DROP;
+}
+
+static gboolean renderer_new (Renderer * renderer) {
+    GError *error = NULL;
+
+    memset (renderer, 0, sizeof (Renderer));
+
+    renderer->pipeline = gst_parse_launch ("espeak name=src ! wavenc ! "
+            "filesink name=sink", &error);
+    if (!renderer->pipeline) {
+        g_printerr ("Cannot create pipeline: %s\n", error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    renderer->src = gst_bin_get_by_name (GST_BIN (renderer->pipeline), "src");
+    renderer->sink = gst_bin_get_by_name (GST_BIN (renderer->pipeline),
+            "sink");
+    renderer->timing = g_string_new (NULL);
+
+    GstCaps *caps;
+    g_object_get (renderer->src, "caps", &caps, NULL);
+    gst_structure_get_int (gst_caps_get_structure (caps, 0), "rate",
+            &renderer->sample_rate);
+    gst_caps_unref (caps);
+
+    GstPad *pad = gst_element_get_static_pad (renderer->src, "src");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, count_samples,
+            renderer, NULL);
+    gst_object_unref (pad);
+
+    GstBus *bus = gst_element_get_bus (renderer->pipeline);
+    gst_bus_set_sync_handler (bus, collect_timing, renderer, NULL);
+    gst_object_unref (bus);
+
+    return TRUE;
+}
+
+static void renderer_free (Renderer * renderer) {
+    gst_element_set_state (renderer->pipeline, GST_STATE_NULL);
+    gst_object_unref (renderer->src);
+    gst_object_unref (renderer->sink);
+    gst_object_unref (renderer->pipeline);
+    g_string_free (renderer->timing, TRUE);
+}
+
+static gboolean render (Renderer * renderer, Item * item) {
+    GError *error = NULL;
+
+    // READY keeps the element and its engine, but lets filesink reopen
+    gst_element_set_state (renderer->pipeline, GST_STATE_READY);
+
+    renderer->samples = 0;
+    g_string_truncate (renderer->timing, 0);
+
+    g_object_set (renderer->src, "text", item->text,
+            "rate", item->rate, "pitch", item->pitch,
+            "track", item->track, NULL);
+    g_object_set (renderer->src, "voice", item->voice ? item->voice :
+            espeak_default_voice (), NULL);
+    g_object_set (renderer->sink, "location", item->output, NULL);
+
+    gst_element_set_state (renderer->pipeline, GST_STATE_PLAYING);
+
+    GstBus *bus = gst_element_get_bus (renderer->pipeline);
+    GstMessage *message = gst_bus_timed_pop_filtered (bus,
+            GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    gboolean ok = GST_MESSAGE_TYPE (message) == GST_MESSAGE_EOS;
+
+    if (!ok) {
+        gst_message_parse_error (message, &error, NULL);
+        g_printerr ("%s: %s\n", item->output, error->message);
+        g_error_free (error);
+    }
+
+    gst_message_unref (message);
+    gst_object_unref (bus);
+
+    // finalize the WAV header
+    gst_element_set_state (renderer->pipeline, GST_STATE_READY);
+
+    if (ok) {
+        gchar *path = g_strconcat (item->output, ".timing", NULL);
+        ok = g_file_set_contents (path, renderer->timing->str,
+                renderer->timing->len, &error);
+        if (!ok) {
+            g_printerr ("%s\n", error->message);
+            g_error_free (error);
+        }
+        g_free (path);
+    }
+
+    return ok;
+}
+
+// string as a JSON string literal
+static gchar *json_string (const gchar * str) {
+    GString *json = g_string_new ("\"");
+
+    for (; *str; ++str) {
+        guchar c = *str;
+
+        if (c == '"' || c == '\\')
+            g_string_append_printf (json, "\\%c", c);
+        else if (c < 0x20)
+            g_string_append_printf (json, "\\u%04x", c);
+        else
+            g_string_append_c (json, c);
+    }
+
+    g_string_append_c (json, '"');
+    return g_string_free (json, FALSE);
+}
+
+static gdouble cpu_time () {
+    struct timespec now;
+
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int worker (GArray * items, Shared * shared, gint id) {
+    Renderer renderer;
+    gint i;
+
+    gst_init (NULL, NULL);
+
+    if (!gst_element_factory_find ("espeak")) {
+        g_printerr ("espeak element is not available, check GST_PLUGIN_PATH\n");
+        return 1;
+    }
+
+    if (!renderer_new (&renderer))
+        return 1;
+
+    while ((i = g_atomic_int_add (&shared->next, 1)) < (gint) items->len) {
+        Item *item = &g_array_index (items, Item, i);
+        Result *result = &shared->results[i];
+        GstClockTime start = monotonic_time ();
+        gdouble cpu_start = cpu_time ();
+
+        result->failed = !render (&renderer, item);
+        result->worker = id;
+        result->wall_sec = (gdouble) (monotonic_time () - start) / GST_SECOND;
+        result->cpu_sec = cpu_time () - cpu_start;
+        if (renderer.sample_rate)
+            result->audio_sec = (gdouble) renderer.samples /
+                    renderer.sample_rate;
+        result->done = TRUE;
+    }
+
+    renderer_free (&renderer);
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int main (int argc, char **argv) {
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new ("MANIFEST - render "
+            "text to WAV files with espeak");
+
+    g_option_context_add_main_entries (context, options, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free (context);
+
+    if (argc != 2) {
+        g_printerr ("Usage: %s [--jobs N] [--track TRACK] MANIFEST\n",
+                argv[0]);
+        return 1;
+    }
+
+    gint track = parse_track (opt_track);
+    if (track < 0) {
+        g_printerr ("Unknown track %s\n", opt_track);
+        return 1;
+    }
+
+    GArray *items = read_manifest (argv[1], track, &error);
+    if (items == NULL) {
+        g_printerr ("%s\n", error->message);
+        return 1;
+    }
+    if (items->len == 0)
+        return 0;
+
+    gint jobs = opt_jobs > 0 ? opt_jobs : (gint) sysconf (_SC_NPROCESSORS_ONLN);
+    jobs = CLAMP (jobs, 1, (gint) items->len);
+
+    gsize shared_size = sizeof (Shared) + items->len * sizeof (Result);
+    Shared *shared = mmap (NULL, shared_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror ("mmap");
+        return 1;
+    }
+    memset (shared, 0, shared_size);
+
+    preload_voices (items);
+
+    // fork before any thread is started, gst_init() happens in workers
+    GstClockTime start = monotonic_time ();
+    gint i;
+
+    for (i = 0; i < jobs; ++i) {
+        pid_t pid = fork ();
+        if (pid < 0) {
+            perror ("fork");
+            jobs = i;
+            break;
+        }
+        if (pid == 0)
+            _exit (worker (items, shared, i));
+    }
+
+    gint status;
+    while (wait (&status) > 0);
+
+    gdouble wall = (gdouble) (monotonic_time () - start) / GST_SECOND;
+    gdouble audio = 0, cpu = 0;
+    guint rendered = 0, failed = 0;
+
+    for (i = 0; i < (gint) items->len; ++i) {
+        Item *item = &g_array_index (items, Item, i);
+        Result *result = &shared->results[i];
+        gchar *output = json_string (item->output);
+
+        if (!result->done || result->failed) {
+            ++failed;
+            g_print ("{\"item\": %d, \"output\": %s, \"ok\": false}\n",
+                    i, output);
+            g_free (output);
+            continue;
+        }
+
+        ++rendered;
+        audio += result->audio_sec;
+        cpu += result->cpu_sec;
+
+        g_print ("{\"item\": %d, \"output\": %s, \"ok\": true, "
+                "\"worker\": %d, \"audio_sec\": %.3f, \"wall_sec\": %.3f, "
+                "\"cpu_sec\": %.3f, \"realtime_factor\": %.3f}\n",
+                i, output, result->worker, result->audio_sec,
+                result->wall_sec, result->cpu_sec,
+                result->wall_sec > 0 ? result->audio_sec / result->wall_sec :
+                0);
+        g_free (output);
+    }
+
+    g_print ("{\"items\": %u, \"failed\": %u, \"jobs\": %d, "
+            "\"audio_sec\": %.3f, \"wall_sec\": %.3f, \"cpu_sec\": %.3f, "
+            "\"items_per_sec\": %.3f, \"realtime_factor\": %.3f}\n",
+            rendered, failed, jobs, audio, wall, cpu,
+            wall > 0 ? rendered / wall : 0, wall > 0 ? audio / wall : 0);
+
+    munmap (shared, shared_size);
+
+    return failed ? 1 : 0;
+}
@@ -17,8 +17,21 @@
  * Boston, MA 02111-1307, USA.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
 #include <glib.h>
 #include <gst/gst.h>
 #include <espeak-ng/speak_lib.h>
@@ -29,7 +42,17 @@
 #define SPIN_QUEUE_SIZE 2
 #define SPIN_FRAME_SIZE 255
 
+#define STATS_WAIT_SIZE 256
+
+#define SEGMENT_CACHE_SIZE 256
+#define SEGMENT_XFADE_MS 3
+
+// characters between checkpoints of Econtext.text_index
+#define TEXT_INDEX_STEP 32
+
 #include "espeak.h"
+#include "backend.h"
+#include "stretch.h"
 
 typedef enum {
     IN = 1,
@@ -42,6 +65,18 @@ typedef enum {
     CLOSE = 2
 } ContextState;
 
+// packed copy of espeak_EVENT, mark names are stored in Espin.marks
+typedef struct {
+    guint32 type:8;
+    guint32 length:24;
+    guint32 sample;
+    guint32 audio_position;
+    // 0-based character position
+    guint32 text_position;
+    // sentence or word number, or mark name offset in Espin.marks
+    guint32 id;
+} Eevent;
+
 typedef struct {
     Econtext *context;
 
@@ -50,26 +85,132 @@ typedef struct {
     GByteArray *sound;
     gsize sound_offset;
     GstClockTime audio_position;
+    // sound synth_cb() has appended so far, espeak_out() of an eager
+    // context plays it while the spin is still in synthesis; guarded by
+    // Econtext.sound_lock
+    gsize available;
 
     GArray *events;
     gsize events_pos;
-
-    int last_word;
-    int mark_offset;
-    const gchar *mark_name;
+    // sound before events_pos event is split into several buffers and the
+    // event itself was already emitted
+    gboolean partial;
+
+    // interned mark names, mark_offsets maps g_str_hash() of a name to
+    // its offset in marks
+    GString *marks;
+    GHashTable *mark_offsets;
+
+    // espeak rate the sound was synthesized with
+    gint synth_rate;
+    Estretch *stretch;
+    gboolean stretching;
 } Espin;
 
+// piece of a template, see espeak_in_template()
+typedef struct {
+    gchar *text;
+    gboolean slot;
+    // character offset in the rendered text
+    guint32 text_offset;
+} Esegment;
+
+// sound of a static template segment
+typedef struct {
+    GByteArray *sound;
+    GArray *events;
+    GString *marks;
+} Ecached;
+
+// sound of a spoken utterance, samples of events are relative to its sound
+typedef struct {
+    GString *text;
+    GByteArray *sound;
+    GArray *events;
+    GString *marks;
+} Ehistory;
+
+typedef struct {
+    GMutex *lock;
+
+    GstClockTime in_time;
+    GstClockTime first_audio;
+    gboolean posted;
+
+    guint64 utterances;
+    guint64 samples;
+    guint64 synths;
+    GstClockTime synth_time;
+    guint64 callbacks;
+    guint64 callback_samples_max;
+    guint64 voice_switches;
+    guint64 cached_segments;
+    guint64 replays;
+
+    guint64 buffers;
+    guint64 buffer_bytes;
+    GstClockTime out_wait;
+
+    guint64 underruns;
+    guint64 preemptions;
+
+    guint64 cancels;
+    GstClockTime cancel_latency;
+    GstClockTime cancel_latency_max;
+
+    GstClockTime queued_at;
+    GstClockTime queue_wait[STATS_WAIT_SIZE];
+    guint64 queue_waits;
+} Estats;
+
 struct _Econtext {
     volatile ContextState state;
+    volatile gint cancel;
 
+    // points to text_buffer while there is an utterance
     gchar *text;
+    GString *text_buffer;
     gsize text_offset;
     gsize text_len;
-    gchar *next_mark;
+    // byte offsets of every TEXT_INDEX_STEP-th character of text
+    GArray *text_index;
 
     Espin queue[SPIN_QUEUE_SIZE];
     Espin *in;
     Espin *out;
+    // stream time the out spin starts at
+    GstClockTime out_base;
+
+    GPtrArray *segments;
+    Espin scratch;
+
+    // whole utterance for random access, see espeak_render()
+    GstBuffer *rendered;
+    GArray *rendered_events;
+    GString *rendered_marks;
+    // events before this byte offset are posted already, re-reads and
+    // typefinding don't post them again
+    guint64 rendered_reported;
+
+    // recently spoken utterances, newest first, at most history_size of
+    // them; while replaying one the rendered range is streamed by
+    // espeak_out()
+    GMutex *history_lock;
+    GQueue *history;
+    // entry the process thread appends synthesized spins to
+    Ehistory *recording;
+    gboolean replaying;
+    guint64 replay_offset;
+
+    // play sound of the in spin as it is synthesized, see espeak_set_eager()
+    volatile gint eager;
+    GMutex *sound_lock;
+    GCond *sound_cond;
+
+    // recycled output buffers, twice the largest block size to leave room
+    // for time-stretched output
+    GstBufferPool *pool;
+    gsize pool_size;
 
     GSList *process_chunk;
 
@@ -78,9 +219,13 @@ struct _Econtext {
     volatile const gchar *voice;
     volatile gint gap;
     volatile gint track;
+    volatile gint stretch;
+    volatile gint history_size;
 
     GstElement *emitter;
     GstBus *bus;
+
+    Estats stats;
 };
 
 static inline void spinning (Espin * base, Espin ** i) {
@@ -88,33 +233,116 @@ static inline void spinning (Espin * base, Espin ** i) {
         *i = base;
 }
 
-static void post_message (Econtext * self, GstStructure * data) {
+static void post (Econtext * self, GstMessage * msg) {
     if (!self->bus)
         self->bus = gst_element_get_bus (self->emitter);
-    GstMessage *msg =
-            gst_message_new_element (GST_OBJECT (self->emitter), data);
     gst_bus_post (self->bus, msg);
 }
 
-static void emit_word (Econtext * self, guint offset, guint len, guint id) {
+static void post_message (Econtext * self, GstStructure * data) {
+    post (self, gst_message_new_element (GST_OBJECT (self->emitter), data));
+}
+
+static inline GstClockTime monotonic_time () {
+    return g_get_monotonic_time () * GST_USECOND;
+}
+
+static inline GstClockTime event_time (Eevent * event) {
+    return gst_util_uint64_scale_int (event->audio_position, GST_SECOND, 1000);
+}
+
+static void text_index_build (Econtext * self) {
+    const gchar *i = self->text;
+    const gchar *end = self->text + self->text_len;
+    guint32 chars;
+
+    g_array_set_size (self->text_index, 0);
+
+    for (chars = 0;; ++chars) {
+        if (chars % TEXT_INDEX_STEP == 0) {
+            guint32 offset = i - self->text;
+            g_array_append_val (self->text_index, offset);
+        }
+        if (i >= end)
+            break;
+        i = g_utf8_next_char (i);
+    }
+}
+
+// byte offset of character offset in text, scans at most TEXT_INDEX_STEP
+// characters from the nearest checkpoint
+static gsize text_byte_offset (Econtext * self, gsize chars) {
+    gsize checkpoint = chars / TEXT_INDEX_STEP;
+
+    if (checkpoint >= self->text_index->len)
+        return self->text_len;
+
+    const gchar *i = self->text + g_array_index (self->text_index, guint32,
+            checkpoint);
+    const gchar *end = self->text + self->text_len;
+
+    for (chars -= checkpoint * TEXT_INDEX_STEP; chars && i < end; --chars)
+        i = g_utf8_next_char (i);
+
+    return MIN (i, end) - self->text;
+}
+
+// time is the stream time the event starts at in the element's output
+static void emit_word (Econtext * self, GstClockTime time, guint offset,
+        guint len, guint id) {
+    gsize byte_offset = text_byte_offset (self, offset);
+    gsize byte_len = text_byte_offset (self, offset + len) - byte_offset;
+
     post_message (self, gst_structure_new ("espeak-word",
+                    "time", G_TYPE_UINT64, time,
                     "offset", G_TYPE_UINT, offset,
-                    "len", G_TYPE_UINT, len, "id", G_TYPE_UINT, id, NULL));
+                    "len", G_TYPE_UINT, len, "id", G_TYPE_UINT, id,
+                    "byte-offset", G_TYPE_UINT, (guint) byte_offset,
+                    "byte-len", G_TYPE_UINT, (guint) byte_len, NULL));
 }
 
-static void emit_sentence (Econtext * self, guint offset, guint len, guint id) {
+static void emit_sentence (Econtext * self, GstClockTime time, guint offset,
+        guint len, guint id) {
+    gsize byte_offset = text_byte_offset (self, offset);
+    gsize byte_len = text_byte_offset (self, offset + len) - byte_offset;
+
     post_message (self, gst_structure_new ("espeak-sentence",
+                    "time", G_TYPE_UINT64, time,
                     "offset", G_TYPE_UINT, offset,
-                    "len", G_TYPE_UINT, len, "id", G_TYPE_UINT, id, NULL));
+                    "len", G_TYPE_UINT, len, "id", G_TYPE_UINT, id,
+                    "byte-offset", G_TYPE_UINT, (guint) byte_offset,
+                    "byte-len", G_TYPE_UINT, (guint) byte_len, NULL));
 }
 
-static void emit_mark (Econtext * self, guint offset, const gchar * mark) {
+static void emit_mark (Econtext * self, GstClockTime time, guint offset,
+        const gchar * mark) {
     post_message (self, gst_structure_new ("espeak-mark",
+                    "time", G_TYPE_UINT64, time,
                     "offset", G_TYPE_UINT, offset,
+                    "byte-offset", G_TYPE_UINT,
+                    (guint) text_byte_offset (self, offset),
                     "mark", G_TYPE_STRING, mark, NULL));
 }
 
+static void emit_event (Econtext * self, Eevent * event, const GString * marks,
+        GstClockTime time) {
+    switch (event->type) {
+    case espeakEVENT_MARK:
+        emit_mark (self, time, event->text_position, marks->str + event->id);
+        break;
+    case espeakEVENT_WORD:
+        emit_word (self, time, event->text_position, event->length,
+                event->id);
+        break;
+    case espeakEVENT_SENTENCE:
+        emit_sentence (self, time, event->text_position, event->length,
+                event->id);
+        break;
+    }
+}
+
 static void init ();
+static void process_in (Econtext *);
 static void process_push (Econtext *, gboolean);
 static void process_pop (Econtext *);
 
@@ -122,10 +350,18 @@ static GThread *process_tid = NULL;
 static GMutex *process_lock = NULL;
 static GCond *process_cond = NULL;
 static GSList *process_queue = NULL;
+// context which is being synthesized without process_lock
+static Econtext *process_current = NULL;
+// serializes the engine between process thread and espeak_preload()
+G_LOCK_DEFINE_STATIC (synth);
 
 static gint espeak_sample_rate = 0;
 static gint espeak_buffer_size = 0;
 static GValueArray *espeak_voices = NULL;
+static GHashTable *segment_cache = NULL;
+static GQueue *segment_cache_order = NULL;
+static gchar *espeak_current_voice = NULL;
+static const Ebackend *backend = NULL;
 
 // -----------------------------------------------------------------------------
 
@@ -137,20 +373,55 @@ const char* espeak_default_voice() {
 #endif
 }
 
+static void spin_init (Espin * spin, Econtext * context) {
+    spin->context = context;
+    spin->state = IN;
+    spin->sound = g_byte_array_new ();
+    spin->events = g_array_new (FALSE, FALSE, sizeof (Eevent));
+    spin->marks = g_string_new (NULL);
+    spin->mark_offsets = g_hash_table_new (g_direct_hash, g_direct_equal);
+    spin->stretch = stretch_new (espeak_sample_rate);
+}
+
+static void spin_free (Espin * spin) {
+    g_byte_array_free (spin->sound, TRUE);
+    g_array_free (spin->events, TRUE);
+    g_string_free (spin->marks, TRUE);
+    g_hash_table_destroy (spin->mark_offsets);
+    stretch_free (spin->stretch);
+}
+
+static void segment_free (Esegment * segment) {
+    g_free (segment->text);
+    g_free (segment);
+}
+
+static void history_free (Ehistory * entry) {
+    g_string_free (entry->text, TRUE);
+    g_byte_array_free (entry->sound, TRUE);
+    g_array_free (entry->events, TRUE);
+    g_string_free (entry->marks, TRUE);
+    g_free (entry);
+}
+
 Econtext *espeak_new (GstElement * emitter) {
     init ();
 
     Econtext *self = g_new0 (Econtext, 1);
     gint i;
 
-    for (i = SPIN_QUEUE_SIZE; i--;) {
-        Espin *spin = &self->queue[i];
-
-        spin->context = self;
-        spin->state = IN;
-        spin->sound = g_byte_array_new ();
-        spin->events = g_array_new (FALSE, FALSE, sizeof (espeak_EVENT));
-    }
+    for (i = SPIN_QUEUE_SIZE; i--;)
+        spin_init (&self->queue[i], self);
+    spin_init (&self->scratch, self);
+
+    self->text_buffer = g_string_new (NULL);
+    self->rendered_events = g_array_new (FALSE, FALSE, sizeof (Eevent));
+    self->rendered_marks = g_string_new (NULL);
+    self->text_index = g_array_new (FALSE, FALSE, sizeof (guint32));
+    self->history_lock = g_mutex_new ();
+    self->history = g_queue_new ();
+    self->sound_lock = g_mutex_new ();
+    self->sound_cond = g_cond_new ();
 
     self->in = self->queue;
     self->out = self->queue;
@@ -168,6 +439,9 @@ Econtext *espeak_new (GstElement * emitter) {
     gst_object_ref (self->emitter);
     self->bus = NULL;
 
+    self->stats.lock = g_mutex_new ();
+    self->stats.first_audio = GST_CLOCK_TIME_NONE;
+
     GST_DEBUG ("[%p]", self);
 
     return self;
@@ -180,20 +454,52 @@ void espeak_unref (Econtext * self) {
 
     gint i;
 
-    for (i = SPIN_QUEUE_SIZE; i--;) {
-        g_byte_array_free (self->queue[i].sound, TRUE);
-        g_array_free (self->queue[i].events, TRUE);
+    for (i = SPIN_QUEUE_SIZE; i--;)
+        spin_free (&self->queue[i]);
+    spin_free (&self->scratch);
+    g_string_free (self->text_buffer, TRUE);
+    g_array_free (self->rendered_events, TRUE);
+    g_string_free (self->rendered_marks, TRUE);
+    g_array_free (self->text_index, TRUE);
+    g_queue_free_full (self->history, (GDestroyNotify) history_free);
+    g_mutex_free (self->history_lock);
+    g_mutex_free (self->sound_lock);
+    g_cond_free (self->sound_cond);
+
+    if (self->pool) {
+        gst_buffer_pool_set_active (self->pool, FALSE);
+        gst_object_unref (self->pool);
     }
 
     g_slist_free (self->process_chunk);
+    g_mutex_free (self->stats.lock);
 
-    gst_object_unref (self->bus);
+    if (self->bus)
+        gst_object_unref (self->bus);
     gst_object_unref (self->emitter);
 
     memset (self, 0, sizeof (Econtext));
     g_free (self);
 }
 
+Econtext *espeak_prepare (Econtext * self, const gchar * text) {
+    Econtext *prepared = espeak_new (self->emitter);
+
+    prepared->pitch = g_atomic_int_get (&self->pitch);
+    prepared->rate = g_atomic_int_get (&self->rate);
+    prepared->voice = g_atomic_pointer_get (&self->voice);
+    prepared->gap = g_atomic_int_get (&self->gap);
+    prepared->track = g_atomic_int_get (&self->track);
+    prepared->stretch = g_atomic_int_get (&self->stretch);
+    prepared->history_size = g_atomic_int_get (&self->history_size);
+
+    GST_DEBUG ("[%p] prepared=%p", self, prepared);
+
+    espeak_in (prepared, text);
+
+    return prepared;
+}
+
 // in/out ----------------------------------------------------------------------
 
 void espeak_in (Econtext * self, const gchar * text) {
@@ -202,18 +508,177 @@ void espeak_in (Econtext * self, const gchar * text) {
     if (text == NULL || *text == 0)
         return;
 
-    self->text = g_strdup (text);
+    g_string_assign (self->text_buffer, text);
+    self->text = self->text_buffer->str;
     self->text_offset = 0;
-    self->text_len = strlen (text);
+    self->text_len = self->text_buffer->len;
+
+    process_in (self);
+}
+
+// start recording the utterance, recycles the oldest one
+static void history_begin (Econtext * self) {
+    guint size = g_atomic_int_get (&self->history_size);
+    Ehistory *entry = NULL;
+
+    g_mutex_lock (self->history_lock);
+    self->recording = NULL;
+    if (size && g_queue_get_length (self->history) >= size)
+        entry = g_queue_pop_tail (self->history);
+    g_mutex_unlock (self->history_lock);
+
+    if (size == 0)
+        return;
+
+    if (entry == NULL) {
+        entry = g_new0 (Ehistory, 1);
+        entry->text = g_string_new (NULL);
+        entry->sound = g_byte_array_new ();
+        entry->events = g_array_new (FALSE, FALSE, sizeof (Eevent));
+        entry->marks = g_string_new (NULL);
+    }
+
+    g_string_assign (entry->text, self->text);
+    g_byte_array_set_size (entry->sound, 0);
+    g_array_set_size (entry->events, 0);
+    g_string_truncate (entry->marks, 0);
+
+    g_mutex_lock (self->history_lock);
+    g_queue_push_head (self->history, entry);
+    self->recording = entry;
+    g_mutex_unlock (self->history_lock);
+}
+
+static void process_in (Econtext * self) {
+    text_index_build (self);
+    self->out_base = 0;
+    history_begin (self);
+
+    g_atomic_int_set (&self->cancel, 0);
+
+    g_mutex_lock (self->stats.lock);
+    self->stats.in_time = monotonic_time ();
+    self->stats.first_audio = GST_CLOCK_TIME_NONE;
+    self->stats.posted = FALSE;
+    self->stats.utterances += 1;
+    g_mutex_unlock (self->stats.lock);
 
     process_push (self, TRUE);
 }
 
+static gdouble stretch_factor (Econtext * self, Espin * spin) {
+    if (!g_atomic_int_get (&self->stretch) || spin->synth_rate == 0)
+        return 1.0;
+    return (gdouble) g_atomic_int_get (&self->rate) / spin->synth_rate;
+}
+
+// timestamp of event in output, taking into account the time-stretching
+static GstClockTime spin_time (Econtext * self, Espin * spin, Eevent * event) {
+    if (!spin->stretching)
+        return event_time (event);
+
+    gdouble samples = event->sample - stretch_position (spin->stretch);
+
+    return spin->audio_position + (GstClockTime) (MAX (samples, 0) /
+            stretch_factor (self, spin) * GST_SECOND / espeak_sample_rate);
+}
+
+// the pool only grows, smaller blocks take buffers of it as they are so
+// that changing block sizes don't reallocate it
+static void pool_configure (Econtext * self, gsize block) {
+    gsize size = block * 2;
+
+    if (self->pool_size >= size)
+        return;
+
+    if (self->pool)
+        gst_buffer_pool_set_active (self->pool, FALSE);
+    else
+        self->pool = gst_buffer_pool_new ();
+
+    GstStructure *config = gst_buffer_pool_get_config (self->pool);
+    gst_buffer_pool_config_set_params (config, NULL, size, 0, 0);
+
+    // the pool refuses new sizes while downstream holds its buffers, leave
+    // it to them and start a new one
+    if (!gst_buffer_pool_set_config (self->pool, config)) {
+        gst_object_unref (self->pool);
+        self->pool = gst_buffer_pool_new ();
+        self->pool_size = 0;
+
+        config = gst_buffer_pool_get_config (self->pool);
+        gst_buffer_pool_config_set_params (config, NULL, size, 0, 0);
+        if (!gst_buffer_pool_set_config (self->pool, config)) {
+            GST_WARNING ("[%p] cannot configure pool for %zd bytes", self,
+                    size);
+            return;
+        }
+    }
+
+    gst_buffer_pool_set_active (self->pool, TRUE);
+    self->pool_size = size;
+}
+
+static GstBuffer *new_buffer (Econtext * self, gsize size) {
+    GstBuffer *out;
+    gsize maxsize;
+
+    if (size <= self->pool_size &&
+            gst_buffer_pool_acquire_buffer (self->pool, &out, NULL) ==
+            GST_FLOW_OK) {
+        gst_buffer_get_sizes (out, NULL, &maxsize);
+        if (maxsize >= size) {
+            gst_buffer_set_size (out, size);
+            return out;
+        }
+        gst_buffer_unref (out);
+    }
+
+    return gst_buffer_new_allocate (NULL, size, NULL);
+}
+
+// time-stretch size_to_play bytes of spin sound to the current rate
+static GstBuffer *play_stretched (Econtext * self, Espin * spin,
+        gsize size_to_play, gdouble factor) {
+    gsize end = (spin->sound_offset + size_to_play) / BYTES_PER_SAMPLE;
+    gboolean flush = spin->sound_offset + size_to_play >= spin->sound->len;
+
+    if (!spin->stretching) {
+        stretch_reset (spin->stretch, spin->sound_offset / BYTES_PER_SAMPLE);
+        spin->stretching = TRUE;
+    }
+
+    gsize samples = stretch_output_size (spin->stretch, end, factor, flush);
+    GstBuffer *out = new_buffer (self, samples * BYTES_PER_SAMPLE);
+    GstMapInfo map;
+
+    gst_buffer_map (out, &map, GST_MAP_WRITE);
+    stretch_process (spin->stretch, (const gint16 *) spin->sound->data,
+            spin->sound->len / BYTES_PER_SAMPLE, end, factor, flush,
+            (gint16 *) map.data);
+    gst_buffer_unmap (out, &map);
+
+    GST_BUFFER_TIMESTAMP (out) = spin->audio_position;
+    spin->audio_position += gst_util_uint64_scale_int (samples, GST_SECOND,
+            espeak_sample_rate);
+    GST_BUFFER_DURATION (out) =
+            spin->audio_position - GST_BUFFER_TIMESTAMP (out);
+
+    GST_DEBUG ("[%p] factor=%f samples=%zd", self, factor, samples);
+
+    return out;
+}
+
 GstBuffer *play (Econtext * self, Espin * spin, gsize size_to_play) {
     inline gsize whole (Espin * spin, gsize size_to_play) {
         for (;; ++spin->events_pos) {
-            espeak_EVENT *i = &g_array_index (spin->events, espeak_EVENT,
+            Eevent *i = &g_array_index (spin->events, Eevent,
                     spin->events_pos);
+
+            // sound up to it was played while in synthesis
+            if (i->sample * BYTES_PER_SAMPLE < spin->sound_offset)
+                continue;
+
             gsize len = i->sample * BYTES_PER_SAMPLE - spin->sound_offset;
 
             if (i->type == espeakEVENT_LIST_TERMINATED || len >= size_to_play)
@@ -221,69 +686,88 @@ GstBuffer *play (Econtext * self, Espin * spin, gsize size_to_play) {
         }
     }
 
-    inline gsize events (Econtext * self, Espin * spin, gsize size_to_play) {
-        gsize spin_size = spin->sound->len;
-        gsize event;
-        gsize sample_offset = 0;
-        espeak_EVENT *i =
-                &g_array_index (spin->events, espeak_EVENT, spin->events_pos);
-
-        GST_DEBUG ("event=%zd i->type=%d i->text_position=%d",
-                event, i->type, i->text_position);
+    // sound up to the next event, which is emitted with the buffer
+    // reaching it
+    inline gsize events (Espin * spin) {
+        Eevent *i = &g_array_index (spin->events, Eevent, spin->events_pos);
 
-        if (i->type == espeakEVENT_LIST_TERMINATED) {
-            sample_offset = spin_size;
-        } else {
-            switch (i->type) {
-            case espeakEVENT_MARK:
-                emit_mark (self, i->text_position, i->id.name);
-                break;
-            case espeakEVENT_WORD:
-                emit_word (self, i->text_position, i->length, i->id.number);
-                break;
-            case espeakEVENT_SENTENCE:
-                emit_sentence (self, i->text_position, i->length, i->id.number);
-                break;
-            }
-        }
+        GST_DEBUG ("i->type=%d i->text_position=%d", i->type,
+                i->text_position);
 
-        if (!sample_offset) {
-            sample_offset = i->sample * BYTES_PER_SAMPLE;
-        }
+        if (i->type == espeakEVENT_LIST_TERMINATED)
+            return spin->sound->len - spin->sound_offset;
 
-        return sample_offset - spin->sound_offset;
+        return i->sample * BYTES_PER_SAMPLE - spin->sound_offset;
     }
 
     g_atomic_int_set (&spin->state, PLAY);
 
+    gdouble factor = stretch_factor (self, spin);
+    gsize block = size_to_play;
+
+    pool_configure (self, block);
+
+    gboolean tracking = FALSE;
+
     switch (g_atomic_int_get (&self->track)) {
     case ESPEAK_TRACK_WORD:
     case ESPEAK_TRACK_MARK:
-        size_to_play = events (self, spin, size_to_play);
+        size_to_play = events (spin);
+        tracking = TRUE;
         break;
     default:
-        size_to_play = whole (spin, size_to_play);
+        size_to_play = whole (spin, size_to_play * factor);
         break;
     }
 
-    espeak_EVENT *event = &g_array_index (spin->events, espeak_EVENT,
-            spin->events_pos);
-
-    GstBuffer *out = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY |
-            GST_MEMORY_FLAG_NO_SHARE,
-            spin->sound->data, spin->sound->len,
-            spin->sound_offset, size_to_play, NULL, NULL);
+    // split long stretches between events into pooled buffers, the event
+    // is emitted only with the last piece
+    gsize limit = block * factor;
+    limit -= limit % BYTES_PER_SAMPLE;
+    spin->partial = limit && size_to_play > limit;
+    if (spin->partial)
+        size_to_play = limit;
+
+    GstBuffer *out;
+
+    if (factor != 1.0 || spin->stretching)
+        out = play_stretched (self, spin, size_to_play, factor);
+    else {
+        out = new_buffer (self, size_to_play);
+        gst_buffer_fill (out, 0, spin->sound->data + spin->sound_offset,
+                size_to_play);
+
+        // derived from samples, event times are rounded to milliseconds
+        GST_BUFFER_TIMESTAMP (out) = gst_util_uint64_scale_int (
+                spin->sound_offset / BYTES_PER_SAMPLE, GST_SECOND,
+                espeak_sample_rate);
+        spin->audio_position = gst_util_uint64_scale_int (
+                (spin->sound_offset + size_to_play) / BYTES_PER_SAMPLE,
+                GST_SECOND, espeak_sample_rate);
+        GST_BUFFER_DURATION (out) =
+                spin->audio_position - GST_BUFFER_TIMESTAMP (out);
+    }
 
+    GST_BUFFER_TIMESTAMP (out) += self->out_base;
     GST_BUFFER_OFFSET (out) = spin->sound_offset;
     GST_BUFFER_OFFSET_END (out) = spin->sound_offset + size_to_play;
-    GST_BUFFER_TIMESTAMP (out) = spin->audio_position;
-    spin->audio_position =
-            gst_util_uint64_scale_int (event->audio_position, GST_SECOND, 1000);
-    GST_BUFFER_DURATION (out) =
-            spin->audio_position - GST_BUFFER_TIMESTAMP (out);
+
+    // posted before the buffer which ends where the event starts
+    if (tracking && !spin->partial)
+        emit_event (self, &g_array_index (spin->events, Eevent,
+                        spin->events_pos), spin->marks,
+                GST_BUFFER_TIMESTAMP (out) + GST_BUFFER_DURATION (out));
 
     spin->sound_offset += size_to_play;
-    spin->events_pos += 1;
+    if (!spin->partial)
+        spin->events_pos += 1;
+
+    g_mutex_lock (self->stats.lock);
+    if (!GST_CLOCK_TIME_IS_VALID (self->stats.first_audio))
+        self->stats.first_audio = monotonic_time () - self->stats.in_time;
+    self->stats.buffers += 1;
+    self->stats.buffer_bytes += size_to_play;
+    g_mutex_unlock (self->stats.lock);
 
     GST_DEBUG ("size_to_play=%zd tell=%zd ts=%" G_GUINT64_FORMAT " dur=%"
             G_GUINT64_FORMAT, size_to_play,
@@ -293,28 +777,134 @@ GstBuffer *play (Econtext * self, Espin * spin, gsize size_to_play) {
     return out;
 }
 
+// sound of the spin which is still in synthesis, without its events, which
+// are left to play() once the spin is out; NULL if synthesis is over
+// before size_to_play bytes are there
+static GstBuffer *play_eager (Econtext * self, Espin * spin,
+        gsize size_to_play) {
+    g_mutex_lock (self->sound_lock);
+    while (spin->available < spin->sound_offset + size_to_play &&
+            g_atomic_int_get (&spin->state) == IN &&
+            !g_atomic_int_get (&self->cancel))
+        g_cond_wait (self->sound_cond, self->sound_lock);
+
+    if (g_atomic_int_get (&spin->state) != IN ||
+            g_atomic_int_get (&self->cancel)) {
+        g_mutex_unlock (self->sound_lock);
+        return NULL;
+    }
+
+    GstBuffer *out = new_buffer (self, size_to_play);
+    gst_buffer_fill (out, 0, spin->sound->data + spin->sound_offset,
+            size_to_play);
+    g_mutex_unlock (self->sound_lock);
+
+    GST_BUFFER_TIMESTAMP (out) = gst_util_uint64_scale_int (
+            spin->sound_offset / BYTES_PER_SAMPLE, GST_SECOND,
+            espeak_sample_rate);
+    spin->audio_position = gst_util_uint64_scale_int (
+            (spin->sound_offset + size_to_play) / BYTES_PER_SAMPLE,
+            GST_SECOND, espeak_sample_rate);
+    GST_BUFFER_DURATION (out) =
+            spin->audio_position - GST_BUFFER_TIMESTAMP (out);
+    GST_BUFFER_TIMESTAMP (out) += self->out_base;
+    GST_BUFFER_OFFSET (out) = spin->sound_offset;
+    GST_BUFFER_OFFSET_END (out) = spin->sound_offset + size_to_play;
+
+    spin->sound_offset += size_to_play;
+
+    g_mutex_lock (self->stats.lock);
+    if (!GST_CLOCK_TIME_IS_VALID (self->stats.first_audio))
+        self->stats.first_audio = monotonic_time () - self->stats.in_time;
+    self->stats.buffers += 1;
+    self->stats.buffer_bytes += size_to_play;
+    g_mutex_unlock (self->stats.lock);
+
+    GST_DEBUG ("[%p] eager size_to_play=%zd ts=%" G_GUINT64_FORMAT, self,
+            size_to_play, GST_BUFFER_TIMESTAMP (out));
+
+    return out;
+}
+
+// the out spin is played, give it back to the process thread
+static void spin_played (Econtext * self, Espin * spin) {
+    self->out_base += spin->audio_position;
+    g_atomic_int_set (&spin->state, IN);
+    process_push (self, FALSE);
+    spinning (self->queue, &self->out);
+}
+
 GstBuffer *espeak_out (Econtext * self, gsize size_to_play) {
     GST_DEBUG ("[%p] size_to_play=%d", self, size_to_play);
 
+    gboolean underrun = FALSE;
+
+    if (self->replaying) {
+        GstBuffer *out = espeak_range (self, self->replay_offset,
+                size_to_play);
+        if (out)
+            self->replay_offset = GST_BUFFER_OFFSET_END (out);
+        return out;
+    }
+
     for (;;) {
         g_mutex_lock (process_lock);
         for (;;) {
             if (g_atomic_int_get (&self->out->state) & (PLAY | OUT))
                 break;
+            // the out spin is in synthesis, there are no events to track
+            // and the sound needs no stretching
+            if (g_atomic_int_get (&self->eager) &&
+                    process_current == self && self->in == self->out &&
+                    !g_atomic_int_get (&self->cancel) &&
+                    g_atomic_int_get (&self->track) == ESPEAK_TRACK_NONE &&
+                    stretch_factor (self, self->out) == 1.0 &&
+                    !self->out->stretching)
+                break;
             if (self->state != INPROCESS) {
-                if (self->state == CLOSE)
+                gboolean closed = self->state == CLOSE;
+                if (closed)
                     GST_DEBUG ("[%p] sesseion is closed", self);
                 else
                     GST_DEBUG ("[%p] nothing to play", self);
                 g_mutex_unlock (process_lock);
+                if (!closed) {
+                    g_mutex_lock (self->stats.lock);
+                    gboolean post = !self->stats.posted;
+                    self->stats.posted = TRUE;
+                    g_mutex_unlock (self->stats.lock);
+                    // element messages are visible to GST_TRACERS through
+                    // the element-post-message hooks
+                    if (post)
+                        post_message (self, espeak_get_stats (self));
+                }
                 return NULL;
             }
             GST_DEBUG ("[%p] wait for processed data", self);
+            GstClockTime wait_start = monotonic_time ();
             g_cond_wait (process_cond, process_lock);
+            GstClockTime waited = monotonic_time () - wait_start;
+            g_mutex_lock (self->stats.lock);
+            self->stats.out_wait += waited;
+            // waiting in the middle of the utterance
+            if (!underrun &&
+                    GST_CLOCK_TIME_IS_VALID (self->stats.first_audio)) {
+                underrun = TRUE;
+                self->stats.underruns += 1;
+            }
+            g_mutex_unlock (self->stats.lock);
         }
         g_mutex_unlock (process_lock);
 
         Espin *spin = self->out;
+
+        if (g_atomic_int_get (&spin->state) == IN) {
+            GstBuffer *out = play_eager (self, spin, size_to_play);
+            if (out)
+                return out;
+            continue;
+        }
+
         gsize spin_size = spin->sound->len;
 
         GST_DEBUG ("[%p] spin=%p spin->sound_offset=%zd spin_size=%zd "
@@ -324,9 +914,7 @@ GstBuffer *espeak_out (Econtext * self, gsize size_to_play) {
 
         if (g_atomic_int_get (&spin->state) == PLAY &&
                 spin->sound_offset >= spin_size) {
-            g_atomic_int_set (&spin->state, IN);
-            process_push (self, FALSE);
-            spinning (self->queue, &self->out);
+            spin_played (self, spin);
             continue;
         }
 
@@ -337,8 +925,424 @@ GstBuffer *espeak_out (Econtext * self, gsize size_to_play) {
     return NULL;
 }
 
+gboolean espeak_ready (Econtext * self) {
+    if (self->replaying)
+        return TRUE;
+
+    g_mutex_lock (process_lock);
+
+    Espin *spin = self->out;
+    gint state = g_atomic_int_get (&spin->state);
+
+    // espeak_out() goes on with the next spin once this one is played
+    if (state == PLAY && spin->sound_offset >= spin->sound->len) {
+        spinning (self->queue, &spin);
+        state = g_atomic_int_get (&spin->state);
+    }
+
+    gboolean ready = (state & (PLAY | OUT)) || self->state != INPROCESS;
+
+    g_mutex_unlock (process_lock);
+
+    return ready;
+}
+
+// position is in stream time, lateness can span several spins
+gsize espeak_skip (Econtext * self, GstClockTime position,
+        GstClockTime * gap_start, GstClockTime * gap_duration) {
+    GstClockTime start = GST_CLOCK_TIME_NONE;
+    gsize skipped = 0;
+
+    for (;;) {
+        Espin *spin = self->out;
+
+        if (!(g_atomic_int_get (&spin->state) & (PLAY | OUT)))
+            break;
+
+        GstClockTime spin_position = position > self->out_base ?
+                position - self->out_base : 0;
+
+        // look for the first word or sentence boundary at or after position
+        gsize events_pos = spin->events_pos;
+        Eevent *i;
+
+        for (;; ++events_pos) {
+            i = &g_array_index (spin->events, Eevent, events_pos);
+            if (i->type == espeakEVENT_LIST_TERMINATED)
+                break;
+            if ((i->type == espeakEVENT_WORD ||
+                            i->type == espeakEVENT_SENTENCE) &&
+                    spin_time (self, spin, i) >= spin_position)
+                break;
+        }
+
+        gsize sound_offset = i->sample * BYTES_PER_SAMPLE;
+        GstClockTime time = spin_time (self, spin, i);
+
+        if (sound_offset <= spin->sound_offset ||
+                time <= spin->audio_position)
+            break;
+
+        if (!GST_CLOCK_TIME_IS_VALID (start))
+            start = self->out_base + spin->audio_position;
+        skipped += (sound_offset - spin->sound_offset) / BYTES_PER_SAMPLE;
+
+        spin->sound_offset = sound_offset;
+        spin->audio_position = time;
+        if (events_pos != spin->events_pos)
+            spin->partial = FALSE;
+        spin->events_pos = events_pos;
+        if (spin->stretching)
+            stretch_reset (spin->stretch, i->sample);
+        g_atomic_int_set (&spin->state, PLAY);
+
+        GST_DEBUG ("[%p] skipped=%zd events_pos=%zd ts=%" G_GUINT64_FORMAT,
+                self, skipped, events_pos, self->out_base +
+                spin->audio_position);
+
+        if (i->type != espeakEVENT_LIST_TERMINATED)
+            break;
+
+        // the rest of the spin is late too, go on with the next one if it
+        // is already synthesized
+        Espin *next = spin;
+        spinning (self->queue, &next);
+        if (!(g_atomic_int_get (&next->state) & OUT))
+            break;
+        spin_played (self, spin);
+    }
+
+    if (skipped == 0)
+        return 0;
+
+    *gap_start = start;
+    *gap_duration = self->out_base + self->out->audio_position - start;
+
+    return skipped;
+}
+
+// random access ----------------------------------------------------------------
+
+gsize espeak_render (Econtext * self) {
+    GByteArray *sound = g_byte_array_new ();
+
+    g_array_set_size (self->rendered_events, 0);
+    g_string_truncate (self->rendered_marks, 0);
+    self->rendered_reported = 0;
+
+    for (;;) {
+        g_mutex_lock (process_lock);
+        while (!(g_atomic_int_get (&self->out->state) & (PLAY | OUT)) &&
+                self->state == INPROCESS)
+            g_cond_wait (process_cond, process_lock);
+        gboolean ready = g_atomic_int_get (&self->out->state) & (PLAY | OUT);
+        g_mutex_unlock (process_lock);
+
+        if (!ready)
+            break;
+
+        Espin *spin = self->out;
+        gsize start = spin->sound_offset / BYTES_PER_SAMPLE;
+        gsize base = sound->len / BYTES_PER_SAMPLE;
+        gsize i;
+
+        for (i = spin->events_pos; i < spin->events->len; ++i) {
+            Eevent event = g_array_index (spin->events, Eevent, i);
+
+            if (event.type == espeakEVENT_LIST_TERMINATED)
+                break;
+
+            event.sample = event.sample - MIN (event.sample, start) + base;
+            if (event.type == espeakEVENT_MARK) {
+                const gchar *mark = spin->marks->str + event.id;
+                event.id = self->rendered_marks->len;
+                g_string_append_len (self->rendered_marks, mark,
+                        strlen (mark) + 1);
+            }
+            g_array_append_val (self->rendered_events, event);
+        }
+
+        g_byte_array_append (sound, spin->sound->data + spin->sound_offset,
+                spin->sound->len - spin->sound_offset);
+
+        g_atomic_int_set (&spin->state, IN);
+        process_push (self, FALSE);
+        spinning (self->queue, &self->out);
+    }
+
+    gsize size = sound->len;
+
+    if (self->rendered)
+        gst_buffer_unref (self->rendered);
+    self->rendered = gst_buffer_new ();
+    gst_buffer_append_memory (self->rendered,
+            gst_memory_new_wrapped (GST_MEMORY_FLAG_READONLY, sound->data,
+                    size, 0, size, sound,
+                    (GDestroyNotify) g_byte_array_unref));
+
+    GST_DEBUG ("[%p] rendered=%zd events=%d", self, size,
+            self->rendered_events->len);
+
+    return size;
+}
+
+gsize espeak_rendered_size (Econtext * self) {
+    return self->rendered ? gst_buffer_get_size (self->rendered) : 0;
+}
+
+GstBuffer *espeak_range (Econtext * self, guint64 offset, gsize size) {
+    gsize total = espeak_rendered_size (self);
+
+    if (offset >= total)
+        return NULL;
+
+    size = MIN (size, total - offset);
+
+    // post events which fall into the range and were not posted yet
+    if (g_atomic_int_get (&self->track) != ESPEAK_TRACK_NONE &&
+            self->rendered_reported < offset + size) {
+        GArray *events = self->rendered_events;
+        guint64 first = MAX (offset, self->rendered_reported);
+        guint from = 0, to = events->len;
+
+        self->rendered_reported = offset + size;
+
+        while (from < to) {
+            guint middle = (from + to) / 2;
+            if ((guint64) g_array_index (events, Eevent, middle).sample *
+                    BYTES_PER_SAMPLE < first)
+                from = middle + 1;
+            else
+                to = middle;
+        }
+
+        for (; from < events->len; ++from) {
+            Eevent *i = &g_array_index (events, Eevent, from);
+
+            if ((guint64) i->sample * BYTES_PER_SAMPLE >= offset + size)
+                break;
+
+            emit_event (self, i, self->rendered_marks,
+                    gst_util_uint64_scale_int (i->sample, GST_SECOND,
+                            espeak_sample_rate));
+        }
+    }
+
+    GstBuffer *out = gst_buffer_copy_region (self->rendered,
+            GST_BUFFER_COPY_MEMORY, offset, size);
+
+    GST_BUFFER_TIMESTAMP (out) = gst_util_uint64_scale_int (offset /
+            BYTES_PER_SAMPLE, GST_SECOND, espeak_sample_rate);
+    GST_BUFFER_DURATION (out) = gst_util_uint64_scale_int ((offset + size) /
+            BYTES_PER_SAMPLE, GST_SECOND, espeak_sample_rate) -
+            GST_BUFFER_TIMESTAMP (out);
+    GST_BUFFER_OFFSET (out) = offset;
+    GST_BUFFER_OFFSET_END (out) = offset + size;
+
+    return out;
+}
+
+// replay ----------------------------------------------------------------------
+
+// sample where the first word or sentence at or after character offset
+// starts
+static gsize history_sample (Ehistory * entry, guint chars) {
+    guint i;
+
+    for (i = 0; i < entry->events->len; ++i) {
+        Eevent *event = &g_array_index (entry->events, Eevent, i);
+        if ((event->type == espeakEVENT_WORD ||
+                        event->type == espeakEVENT_SENTENCE) &&
+                event->text_position >= chars)
+            return event->sample;
+    }
+
+    return entry->sound->len / BYTES_PER_SAMPLE;
+}
+
+// append sound of the synthesized spin to the utterance being recorded,
+// called by the process thread; history_lock only keeps espeak_replay()
+// and trimming off the entry
+static void history_record (Econtext * self, Espin * spin) {
+    guint32 base;
+    guint i;
+
+    g_mutex_lock (self->history_lock);
+
+    Ehistory *entry = self->recording;
+
+    if (entry == NULL) {
+        g_mutex_unlock (self->history_lock);
+        return;
+    }
+
+    base = entry->sound->len / BYTES_PER_SAMPLE;
+
+    for (i = 0; i < spin->events->len; ++i) {
+        Eevent event = g_array_index (spin->events, Eevent, i);
+
+        if (event.type == espeakEVENT_LIST_TERMINATED)
+            break;
+
+        event.sample += base;
+        if (event.type == espeakEVENT_MARK) {
+            const gchar *mark = spin->marks->str + event.id;
+            event.id = entry->marks->len;
+            g_string_append_len (entry->marks, mark, strlen (mark) + 1);
+        }
+        g_array_append_val (entry->events, event);
+    }
+
+    g_byte_array_append (entry->sound, spin->sound->data, spin->sound->len);
+
+    g_mutex_unlock (self->history_lock);
+}
+
+// the utterance is cancelled in synthesis, its entry would replay only a
+// part of it
+static void history_abort (Econtext * self) {
+    g_mutex_lock (self->history_lock);
+
+    Ehistory *entry = self->recording;
+
+    if (entry) {
+        g_queue_remove (self->history, entry);
+        history_free (entry);
+        self->recording = NULL;
+    }
+
+    g_mutex_unlock (self->history_lock);
+}
+
+guint espeak_get_history_size (Econtext * self) {
+    g_mutex_lock (self->history_lock);
+    guint size = g_queue_get_length (self->history);
+    g_mutex_unlock (self->history_lock);
+
+    return size;
+}
+
+// drop utterances beyond size, returns them to be freed without the lock
+static GList *history_trim (Econtext * self, guint size) {
+    GList *dropped = NULL;
+
+    while (g_queue_get_length (self->history) > size) {
+        Ehistory *entry = g_queue_pop_tail (self->history);
+        if (entry == self->recording)
+            self->recording = NULL;
+        dropped = g_list_prepend (dropped, entry);
+    }
+
+    return dropped;
+}
+
+void espeak_set_history_size (Econtext * self, guint value) {
+    g_atomic_int_set (&self->history_size, value);
+
+    g_mutex_lock (self->history_lock);
+    GList *dropped = history_trim (self, value);
+    g_mutex_unlock (self->history_lock);
+
+    g_list_free_full (dropped, (GDestroyNotify) history_free);
+}
+
+// keep utterances spoken by previous in front of a prepared context which
+// takes its place
+void espeak_inherit_history (Econtext * self, Econtext * previous) {
+    g_mutex_lock (previous->history_lock);
+    GQueue *inherited = previous->history;
+    previous->history = g_queue_new ();
+    previous->recording = NULL;
+    g_mutex_unlock (previous->history_lock);
+
+    g_mutex_lock (self->history_lock);
+    while (!g_queue_is_empty (inherited))
+        g_queue_push_tail (self->history, g_queue_pop_head (inherited));
+    GList *dropped = history_trim (self,
+            g_atomic_int_get (&self->history_size));
+    g_mutex_unlock (self->history_lock);
+
+    g_queue_free (inherited);
+    g_list_free_full (dropped, (GDestroyNotify) history_free);
+}
+
+gsize espeak_replay (Econtext * self, guint utterance, guint start,
+        guint end) {
+    g_mutex_lock (self->history_lock);
+
+    Ehistory *entry = g_queue_peek_nth (self->history, utterance);
+
+    if (entry == NULL) {
+        g_mutex_unlock (self->history_lock);
+        return 0;
+    }
+
+    gsize from = start ? history_sample (entry, start) : 0;
+    gsize to = end > start ? history_sample (entry, end) :
+            entry->sound->len / BYTES_PER_SAMPLE;
+
+    if (from >= to) {
+        g_mutex_unlock (self->history_lock);
+        return 0;
+    }
+
+    // messages refer to the replayed text
+    g_string_assign (self->text_buffer, entry->text->str);
+    self->text = self->text_buffer->str;
+    self->text_len = self->text_buffer->len;
+    self->text_offset = self->text_len;
+    text_index_build (self);
+
+    g_array_set_size (self->rendered_events, 0);
+    g_string_truncate (self->rendered_marks, 0);
+    self->rendered_reported = 0;
+
+    guint i;
+
+    for (i = 0; i < entry->events->len; ++i) {
+        Eevent event = g_array_index (entry->events, Eevent, i);
+
+        if (event.sample < from)
+            continue;
+        if (event.sample >= to)
+            break;
+
+        event.sample -= from;
+        if (event.type == espeakEVENT_MARK) {
+            const gchar *mark = entry->marks->str + event.id;
+            event.id = self->rendered_marks->len;
+            g_string_append_len (self->rendered_marks, mark,
+                    strlen (mark) + 1);
+        }
+        g_array_append_val (self->rendered_events, event);
+    }
+
+    gsize size = (to - from) * BYTES_PER_SAMPLE;
+
+    if (self->rendered)
+        gst_buffer_unref (self->rendered);
+    self->rendered = gst_buffer_new_allocate (NULL, size, NULL);
+    gst_buffer_fill (self->rendered, 0,
+            entry->sound->data + from * BYTES_PER_SAMPLE, size);
+
+    g_mutex_unlock (self->history_lock);
+
+    self->replaying = TRUE;
+    self->replay_offset = 0;
+
+    g_mutex_lock (self->stats.lock);
+    self->stats.replays += 1;
+    g_mutex_unlock (self->stats.lock);
+
+    GST_DEBUG ("[%p] utterance=%u start=%u end=%u size=%zd", self,
+            utterance, start, end, size);
+
+    return size;
+}
+
 void espeak_reset (Econtext * self) {
     process_pop (self);
+    self->replaying = FALSE;
 
     GstBuffer *buf;
     while ((buf = espeak_out (self, espeak_buffer_size)) != NULL)
@@ -348,26 +1352,82 @@ void espeak_reset (Econtext * self) {
     for (i = SPIN_QUEUE_SIZE; i--;)
         g_atomic_int_set (&self->queue[i].state, IN);
 
-    if (self->text) {
-        g_free (self->text);
-        self->text = NULL;
+    self->text = NULL;
+    self->out_base = 0;
+
+    if (self->rendered) {
+        gst_buffer_unref (self->rendered);
+        self->rendered = NULL;
     }
 
-    self->next_mark = NULL;
+    if (self->segments) {
+        g_ptr_array_free (self->segments, TRUE);
+        self->segments = NULL;
+    }
 }
 
 // espeak ----------------------------------------------------------------------
 
+// names are only stored in the arena, the table is keyed by their hashes
+// and colliding names are looked up by scanning the arena
+static guint32 intern_mark (Espin * spin, const gchar * name) {
+    gpointer hash = GUINT_TO_POINTER (g_str_hash (name));
+    gpointer offset;
+    gboolean hashed = g_hash_table_lookup_extended (spin->mark_offsets, hash,
+            NULL, &offset);
+
+    if (hashed) {
+        const gchar *i = spin->marks->str + GPOINTER_TO_UINT (offset);
+        const gchar *end = spin->marks->str + spin->marks->len;
+
+        if (strcmp (i, name) == 0)
+            return GPOINTER_TO_UINT (offset);
+
+        for (i = spin->marks->str; i < end; i += strlen (i) + 1)
+            if (strcmp (i, name) == 0)
+                return i - spin->marks->str;
+    }
+
+    guint32 result = spin->marks->len;
+    g_string_append_len (spin->marks, name, strlen (name) + 1);
+    if (!hashed)
+        g_hash_table_insert (spin->mark_offsets, hash,
+                GUINT_TO_POINTER (result));
+
+    return result;
+}
+
 static gint synth_cb (short *data, int numsamples, espeak_EVENT * events) {
     if (data == NULL)
         return 0;
 
     Espin *spin = events->user_data;
+
+    // warming up synthesis, see espeak_preload()
+    if (spin == NULL)
+        return 0;
+
     Econtext *self = spin->context;
 
+    // abort synthesis, process_pop() is waiting for it
+    if (g_atomic_int_get (&self->cancel)) {
+        GST_DEBUG ("[%p] cancel synthesis", self);
+        return 1;
+    }
+
+    g_mutex_lock (self->stats.lock);
+    self->stats.callbacks += 1;
+    self->stats.callback_samples_max =
+            MAX (self->stats.callback_samples_max, numsamples);
+    g_mutex_unlock (self->stats.lock);
+
     if (numsamples > 0) {
+        g_mutex_lock (self->sound_lock);
         g_byte_array_append (spin->sound, (const guint8 *) data,
                 numsamples * BYTES_PER_SAMPLE);
+        spin->available = spin->sound->len;
+        g_cond_broadcast (self->sound_cond);
+        g_mutex_unlock (self->sound_lock);
 
         espeak_EVENT *i;
 
@@ -377,25 +1437,22 @@ static gint synth_cb (short *data, int numsamples, espeak_EVENT * events) {
                     i->type, i->text_position, i->length,
                     i->audio_position, i->sample * BYTES_PER_SAMPLE);
 
+            Eevent event;
+
+            event.type = i->type;
+            event.length = i->length;
+            event.sample = i->sample;
+            event.audio_position = i->audio_position;
             // convert to 0-based position
-            --i->text_position;
-
-            if (i->type == espeakEVENT_MARK) {
-                // point mark name to our text substring instead of
-                // one which was temporally allocated by espeak
-                if (self->next_mark == NULL)
-                    self->next_mark = self->text;
-                int mark_len = strlen (i->id.name);
-                strncpy (self->next_mark, i->id.name, mark_len);
-                i->id.name = self->next_mark;
-                self->next_mark[mark_len] = '\0';
-                self->next_mark += mark_len + 1;
-            }
+            event.text_position = MAX (0, i->text_position - 1);
 
-            GST_DEBUG ("text_position=%d length=%d",
-                    i->text_position, i->length);
+            if (i->type == espeakEVENT_MARK)
+                // copy mark name which was temporally allocated by espeak
+                event.id = intern_mark (spin, i->id.name);
+            else
+                event.id = i->id.number;
 
-            g_array_append_val (spin->events, *i);
+            g_array_append_val (spin->events, event);
         }
     }
 
@@ -404,20 +1461,51 @@ static gint synth_cb (short *data, int numsamples, espeak_EVENT * events) {
     return 0;
 }
 
-static void synth (Econtext * self, Espin * spin) {
+static void spin_reset (Econtext * self, Espin * spin) {
     g_byte_array_set_size (spin->sound, 0);
     g_array_set_size (spin->events, 0);
     spin->sound_offset = 0;
     spin->audio_position = 0;
+    spin->available = 0;
     spin->events_pos = 0;
-    spin->mark_offset = 0;
-    spin->mark_name = NULL;
-    spin->last_word = -1;
+    spin->partial = FALSE;
+    g_string_truncate (spin->marks, 0);
+    g_hash_table_remove_all (spin->mark_offsets);
+    spin->synth_rate = g_atomic_int_get (&self->rate);
+    spin->stretching = FALSE;
+}
+
+// render text to the end of spin
+static void synth_text (Econtext * self, Espin * spin, const gchar * text,
+        gsize text_len, gint flags) {
+    gsize samples = spin->sound->len / BYTES_PER_SAMPLE;
+    GstClockTime synth_start = monotonic_time ();
+
+    backend->synth (text, text_len + 1, flags, spin);
+
+    g_mutex_lock (self->stats.lock);
+    self->stats.synths += 1;
+    self->stats.synth_time += monotonic_time () - synth_start;
+    self->stats.samples += spin->sound->len / BYTES_PER_SAMPLE - samples;
+    g_mutex_unlock (self->stats.lock);
+}
+
+static void synth_template (Econtext *, Espin *, gint flags);
+
+// spin is reset by the caller
+static void synth (Econtext * self, Espin * spin) {
+    const gchar *voice = (const gchar *) g_atomic_pointer_get (&self->voice);
+    gboolean voice_switch = g_strcmp0 (voice, espeak_current_voice) != 0;
+
+    if (voice_switch) {
+        g_free (espeak_current_voice);
+        espeak_current_voice = g_strdup (voice);
+    }
 
-    espeak_SetParameter (espeakPITCH, g_atomic_int_get (&self->pitch), 0);
-    espeak_SetParameter (espeakRATE, g_atomic_int_get (&self->rate), 0);
-    espeak_SetVoiceByName ((gchar *) g_atomic_pointer_get (&self->voice));
-    espeak_SetParameter (espeakWORDGAP, g_atomic_int_get (&self->gap), 0);
+    backend->set_parameter (espeakPITCH, g_atomic_int_get (&self->pitch));
+    backend->set_parameter (espeakRATE, g_atomic_int_get (&self->rate));
+    backend->set_voice (voice);
+    backend->set_parameter (espeakWORDGAP, g_atomic_int_get (&self->gap));
 
     gint track = g_atomic_int_get (&self->track);
 
@@ -427,19 +1515,275 @@ static void synth (Econtext * self, Espin * spin) {
 
     GST_DEBUG ("[%p] text_offset=%zd", self, self->text_offset);
 
-    espeak_Synth (self->text, self->text_len + 1, 0, POS_CHARACTER, 0, flags,
-            NULL, spin);
+    if (voice_switch) {
+        g_mutex_lock (self->stats.lock);
+        self->stats.voice_switches += 1;
+        g_mutex_unlock (self->stats.lock);
+    }
+
+    if (self->segments) {
+        synth_template (self, spin, flags);
+        self->text_offset = self->text_len;
+    } else {
+        synth_text (self, spin, self->text, self->text_len, flags);
 
-    if (spin->events->len) {
-        int text_offset = g_array_index (spin->events, espeak_EVENT,
-                spin->events->len - 1).text_position + 1;
-        self->text_offset = g_utf8_offset_to_pointer (self->text, text_offset)
-                - self->text;
+        if (spin->events->len) {
+            int text_offset = g_array_index (spin->events, Eevent,
+                    spin->events->len - 1).text_position + 1;
+            self->text_offset = text_byte_offset (self, text_offset);
+        }
     }
 
-    espeak_EVENT last_event = { espeakEVENT_LIST_TERMINATED };
+    Eevent last_event = { espeakEVENT_LIST_TERMINATED };
     last_event.sample = spin->sound->len / BYTES_PER_SAMPLE;
+    last_event.audio_position = gst_util_uint64_scale_int (last_event.sample,
+            1000, espeak_sample_rate);
     g_array_append_val (spin->events, last_event);
+
+    // synth_cb() aborted synthesis, the spin has a part of the sound only
+    if (g_atomic_int_get (&self->cancel))
+        history_abort (self);
+    else
+        history_record (self, spin);
+}
+
+// templates -------------------------------------------------------------------
+
+void espeak_in_template (Econtext * self, const gchar * template,
+        const GstStructure * slots) {
+    GST_DEBUG ("[%p] template=%s", self, template);
+
+    if (template == NULL || *template == 0)
+        return;
+
+    GString *text = self->text_buffer;
+    const gchar *i = template;
+    guint32 chars = 0;
+
+    g_string_truncate (text, 0);
+
+    self->segments = g_ptr_array_new_with_free_func ((GDestroyNotify)
+            segment_free);
+
+    while (*i) {
+        const gchar *left = strchr (i, '{');
+        const gchar *right = left ? strchr (left, '}') : NULL;
+        const gchar *end = right ? left : i + strlen (i);
+        Esegment *segment;
+
+        if (end > i) {
+            segment = g_new0 (Esegment, 1);
+            segment->text = g_strndup (i, end - i);
+            segment->text_offset = chars;
+            chars += g_utf8_strlen (segment->text, -1);
+            g_string_append (text, segment->text);
+            g_ptr_array_add (self->segments, segment);
+        }
+
+        if (right == NULL)
+            break;
+
+        gchar *name = g_strndup (left + 1, right - left - 1);
+        const GValue *value = gst_structure_get_value (slots, name);
+        GValue string = { 0 };
+
+        g_value_init (&string, G_TYPE_STRING);
+        if (value == NULL || !g_value_transform (value, &string))
+            GST_WARNING ("[%p] no value for slot %s", self, name);
+        g_free (name);
+
+        const gchar *slot_text = g_value_get_string (&string);
+        if (slot_text && *slot_text) {
+            segment = g_new0 (Esegment, 1);
+            segment->text = g_strdup (slot_text);
+            segment->slot = TRUE;
+            segment->text_offset = chars;
+            chars += g_utf8_strlen (segment->text, -1);
+            g_string_append (text, segment->text);
+            g_ptr_array_add (self->segments, segment);
+        }
+        g_value_unset (&string);
+
+        i = right + 1;
+    }
+
+    if (text->len == 0) {
+        g_ptr_array_free (self->segments, TRUE);
+        self->segments = NULL;
+        return;
+    }
+
+    self->text_len = text->len;
+    self->text = text->str;
+    self->text_offset = 0;
+
+    process_in (self);
+}
+
+static void cached_free (Ecached * cached) {
+    g_byte_array_free (cached->sound, TRUE);
+    g_array_free (cached->events, TRUE);
+    g_string_free (cached->marks, TRUE);
+    g_free (cached);
+}
+
+static Ecached *cache_lookup (const gchar * key) {
+    if (segment_cache == NULL) {
+        segment_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                g_free, (GDestroyNotify) cached_free);
+        segment_cache_order = g_queue_new ();
+    }
+
+    return g_hash_table_lookup (segment_cache, key);
+}
+
+static Ecached *cache_insert (const gchar * key, Espin * spin) {
+    Ecached *cached = g_new (Ecached, 1);
+
+    cached->sound = g_byte_array_sized_new (spin->sound->len);
+    g_byte_array_append (cached->sound, spin->sound->data, spin->sound->len);
+    cached->events = g_array_sized_new (FALSE, FALSE, sizeof (Eevent),
+            spin->events->len);
+    g_array_append_vals (cached->events, spin->events->data,
+            spin->events->len);
+    cached->marks = g_string_new_len (spin->marks->str, spin->marks->len);
+
+    if (g_queue_get_length (segment_cache_order) >= SEGMENT_CACHE_SIZE)
+        g_hash_table_remove (segment_cache,
+                g_queue_pop_head (segment_cache_order));
+
+    gchar *own_key = g_strdup (key);
+    g_hash_table_insert (segment_cache, own_key, cached);
+    g_queue_push_tail (segment_cache_order, own_key);
+
+    return cached;
+}
+
+// stitch segment sound to the end of spin with a short crossfade
+static void append_segment (Espin * spin, GByteArray * sound, GArray * events,
+        GString * marks, guint32 text_offset) {
+    const gint16 *src = (const gint16 *) sound->data;
+    gsize src_len = sound->len / BYTES_PER_SAMPLE;
+    gsize base = spin->sound->len / BYTES_PER_SAMPLE;
+    gsize fade = MIN (SEGMENT_XFADE_MS * espeak_sample_rate / 1000,
+            MIN (base, src_len));
+    guint32 words = 0, sentences = 0;
+    gsize i;
+
+    base -= fade;
+
+    gint16 *dst = (gint16 *) spin->sound->data + base;
+    for (i = 0; i < fade; ++i)
+        dst[i] = ((gint) dst[i] * (gint) (fade - i) + (gint) src[i] * (gint) i)
+                / (gint) fade;
+    g_byte_array_append (spin->sound, sound->data + fade * BYTES_PER_SAMPLE,
+            (src_len - fade) * BYTES_PER_SAMPLE);
+
+    // continue word and sentence numbering of previous segments
+    for (i = spin->events->len; i--;) {
+        Eevent *event = &g_array_index (spin->events, Eevent, i);
+        if (event->type == espeakEVENT_WORD)
+            words = MAX (words, event->id);
+        else if (event->type == espeakEVENT_SENTENCE)
+            sentences = MAX (sentences, event->id);
+    }
+
+    for (i = 0; i < events->len; ++i) {
+        Eevent event = g_array_index (events, Eevent, i);
+
+        event.sample += base;
+        event.audio_position = gst_util_uint64_scale_int (event.sample, 1000,
+                espeak_sample_rate);
+        event.text_position += text_offset;
+
+        if (event.type == espeakEVENT_MARK)
+            event.id = intern_mark (spin, marks->str + event.id);
+        else if (event.type == espeakEVENT_WORD)
+            event.id += words;
+        else if (event.type == espeakEVENT_SENTENCE)
+            event.id += sentences;
+
+        g_array_append_val (spin->events, event);
+    }
+}
+
+static void synth_template (Econtext * self, Espin * spin, gint flags) {
+    Espin *scratch = &self->scratch;
+    guint i;
+
+    for (i = 0; i < self->segments->len; ++i) {
+        Esegment *segment = g_ptr_array_index (self->segments, i);
+        Ecached *cached = NULL;
+        gchar *key = NULL;
+
+        if (!segment->slot) {
+            const gchar *voice = g_atomic_pointer_get (&self->voice);
+
+            key = g_strdup_printf ("%s|%d|%d|%d|%d|%s", voice ? voice : "",
+                    g_atomic_int_get (&self->pitch),
+                    g_atomic_int_get (&self->rate),
+                    g_atomic_int_get (&self->gap), flags, segment->text);
+            cached = cache_lookup (key);
+        }
+
+        if (cached) {
+            GST_DEBUG ("[%p] cached segment '%s'", self, segment->text);
+            g_mutex_lock (self->stats.lock);
+            self->stats.cached_segments += 1;
+            g_mutex_unlock (self->stats.lock);
+            append_segment (spin, cached->sound, cached->events,
+                    cached->marks, segment->text_offset);
+        } else {
+            GST_DEBUG ("[%p] synth segment '%s'", self, segment->text);
+            spin_reset (self, scratch);
+            synth_text (self, scratch, segment->text, strlen (segment->text),
+                    flags);
+
+            if (g_atomic_int_get (&self->cancel)) {
+                g_free (key);
+                break;
+            }
+
+            if (key)
+                cache_insert (key, scratch);
+            append_segment (spin, scratch->sound, scratch->events,
+                    scratch->marks, segment->text_offset);
+        }
+
+        g_free (key);
+    }
+}
+
+gint espeak_preload (const gchar * voices) {
+    static const gchar warm_up[] = "Hello.";
+    gchar **names = g_strsplit (voices, ",", -1);
+    gchar **i;
+    gint count = 0;
+
+    init ();
+
+    // one voice at a time, so elements can synthesize in between
+    for (i = names; *i; ++i) {
+        gchar *name = g_strstrip (*i);
+        if (*name == 0)
+            continue;
+
+        GST_DEBUG ("preload %s", name);
+
+        G_LOCK (synth);
+        backend->set_voice (name);
+        backend->synth (warm_up, sizeof (warm_up), espeakCHARS_UTF8, NULL);
+
+        g_free (espeak_current_voice);
+        espeak_current_voice = g_strdup (name);
+        G_UNLOCK (synth);
+
+        ++count;
+    }
+
+    g_strfreev (names);
+
+    return count;
 }
 
 gint espeak_get_sample_rate () {
@@ -487,9 +1831,126 @@ void espeak_set_track (Econtext * self, guint value) {
     g_atomic_int_set (&self->track, value);
 }
 
+void espeak_set_stretch (Econtext * self, gboolean value) {
+    g_atomic_int_set (&self->stretch, value);
+}
+
+void espeak_set_eager (Econtext * self, gboolean value) {
+    g_atomic_int_set (&self->eager, value);
+}
+
 // process ----------------------------------------------------------------------
 
+#ifdef HAVE_SCHED_SETAFFINITY
+// CPUs like "0-3,8"
+static gboolean parse_cpus (const gchar * cpus, cpu_set_t * set) {
+    gchar **ranges = g_strsplit (cpus, ",", -1);
+    gchar **i;
+
+    CPU_ZERO (set);
+
+    for (i = ranges; *i; ++i) {
+        gchar *end;
+        guint64 first = g_ascii_strtoull (*i, &end, 10);
+        guint64 last = first;
+
+        if (end == *i)
+            continue;
+        if (*end == '-')
+            last = g_ascii_strtoull (end + 1, NULL, 10);
+
+        for (; first <= last && first < CPU_SETSIZE; ++first)
+            CPU_SET (first, set);
+    }
+
+    g_strfreev (ranges);
+
+    return CPU_COUNT (set) > 0;
+}
+#endif
+
+// the process thread is shared by all elements, so it is placed by
+// environment variables:
+//   GST_ESPEAK_CPUS=0-3,8     pin it to CPUs, spin sound is grown by the
+//                             thread and so first touched on their NUMA node
+//   GST_ESPEAK_SCHED=fifo:10  SCHED_FIFO, or "rr", with priority
+//   GST_ESPEAK_SCHED=nice:-5  nice level of the thread
+// where the system has no way to do that they are logged and ignored
+static void process_setup () {
+    const gchar *cpus = g_getenv ("GST_ESPEAK_CPUS");
+    const gchar *sched = g_getenv ("GST_ESPEAK_SCHED");
+
+    if (cpus) {
+#ifdef HAVE_SCHED_SETAFFINITY
+        cpu_set_t set;
+
+        if (!parse_cpus (cpus, &set))
+            GST_WARNING ("no CPUs in GST_ESPEAK_CPUS=%s", cpus);
+        else if (sched_setaffinity (0, sizeof (set), &set) < 0)
+            GST_WARNING ("cannot pin process thread to %s: %s", cpus,
+                    g_strerror (errno));
+        else
+            GST_INFO ("process thread pinned to %s", cpus);
+#else
+        GST_WARNING ("GST_ESPEAK_CPUS=%s is not supported here, ignored",
+                cpus);
+#endif
+    }
+
+    if (sched) {
+        gchar **parts = g_strsplit (sched, ":", 2);
+        gint value = parts[1] ? atoi (parts[1]) : 0;
+        gint result = -1;
+
+        errno = EINVAL;
+
+        if (strcmp (parts[0], "fifo") == 0 || strcmp (parts[0], "rr") == 0) {
+            gint policy = parts[0][0] == 'f' ? SCHED_FIFO : SCHED_RR;
+            struct sched_param param = { 0 };
+
+            param.sched_priority = value ? value :
+                    sched_get_priority_min (policy);
+            result = pthread_setschedparam (pthread_self (), policy, &param);
+            if (result) {
+                errno = result;
+                result = -1;
+            }
+        } else if (strcmp (parts[0], "nice") == 0) {
+#if HAVE_DECL_SYS_GETTID
+            result = setpriority (PRIO_PROCESS, syscall (SYS_gettid), value);
+#else
+            // nice of another thread would renice the whole process
+            errno = ENOSYS;
+#endif
+        }
+
+        if (result < 0)
+            GST_WARNING ("cannot apply GST_ESPEAK_SCHED=%s: %s", sched,
+                    g_strerror (errno));
+        else
+            GST_INFO ("process thread scheduling %s", sched);
+
+        g_strfreev (parts);
+    }
+}
+
+// times the calling thread was preempted
+static guint64 thread_preemptions () {
+#if HAVE_DECL_RUSAGE_THREAD
+    struct rusage usage;
+
+    if (getrusage (RUSAGE_THREAD, &usage) < 0)
+        return 0;
+
+    return usage.ru_nivcsw;
+#else
+    return 0;
+#endif
+}
+
 static gpointer process (gpointer data) {
+    process_setup ();
+
     g_mutex_lock (process_lock);
 
     for (;;) {
@@ -502,7 +1963,8 @@ static gpointer process (gpointer data) {
 
             process_queue = g_slist_remove_link (process_queue, process_queue);
 
-            if (context->state == CLOSE) {
+            if (context->state == CLOSE ||
+                    g_atomic_int_get (&context->cancel)) {
                 GST_DEBUG ("[%p] session is closed", context);
                 continue;
             }
@@ -510,16 +1972,56 @@ static gpointer process (gpointer data) {
             GST_DEBUG ("[%p] context->text_offset=%d context->text_len=%d",
                     context, context->text_offset, context->text_len);
 
+            g_mutex_lock (context->stats.lock);
+            context->stats.queue_wait[context->stats.queue_waits++ %
+                    STATS_WAIT_SIZE] =
+                    monotonic_time () - context->stats.queued_at;
+            g_mutex_unlock (context->stats.lock);
+
             if (context->text_offset >= context->text_len) {
                 GST_DEBUG ("[%p] end of text to process", context);
                 context->state &= ~INPROCESS;
             } else {
+                guint64 preemptions = thread_preemptions ();
+
+                // synthesize without process_lock, other elements can
+                // queue and stop meanwhile, process_pop() of this one
+                // waits for process_current; the spin is reset before,
+                // espeak_out() of an eager context may read it meanwhile
+                spin_reset (context, spin);
+                process_current = context;
+                g_mutex_unlock (process_lock);
+
+                G_LOCK (synth);
                 synth (context, spin);
+                G_UNLOCK (synth);
+
+                g_mutex_lock (process_lock);
+                process_current = NULL;
+                g_cond_broadcast (process_cond);
+
+                g_mutex_lock (context->stats.lock);
+                context->stats.preemptions +=
+                        thread_preemptions () - preemptions;
+                g_mutex_unlock (context->stats.lock);
+
+                if (context->state == CLOSE ||
+                        g_atomic_int_get (&context->cancel)) {
+                    GST_DEBUG ("[%p] synthesis is cancelled", context);
+                    continue;
+                }
+
                 g_atomic_int_set (&spin->state, OUT);
                 spinning (context->queue, &context->in);
 
+                // wake espeak_out() waiting for more of its sound
+                g_mutex_lock (context->sound_lock);
+                g_cond_broadcast (context->sound_cond);
+                g_mutex_unlock (context->sound_lock);
+
                 if (g_atomic_int_get (&context->in->state) == IN) {
                     GST_DEBUG ("[%p] continue to process data", context);
+                    context->stats.queued_at = monotonic_time ();
                     process_queue = g_slist_concat (process_queue,
                             context->process_chunk);
                 } else {
@@ -545,6 +2047,7 @@ static void process_push (Econtext * context, gboolean force_in) {
         GST_DEBUG ("[%p] state=%d", context, context->state);
     else if (context->state != INPROCESS) {
         context->state = INPROCESS;
+        context->stats.queued_at = monotonic_time ();
         process_queue = g_slist_concat (process_queue, context->process_chunk);
         g_cond_broadcast (process_cond);
     }
@@ -554,15 +2057,122 @@ static void process_push (Econtext * context, gboolean force_in) {
 }
 
 static void process_pop (Econtext * context) {
+    GstClockTime cancel_at = monotonic_time ();
+
+    // make synth_cb abort synthesis of this context, so the process thread
+    // is done with it after at most one SYNC_BUFFER_SIZE_MS chunk of sound;
+    // other contexts are synthesized without process_lock and don't delay
+    // this
+    g_atomic_int_set (&context->cancel, 1);
+
+    g_mutex_lock (context->sound_lock);
+    g_cond_broadcast (context->sound_cond);
+    g_mutex_unlock (context->sound_lock);
+
     GST_DEBUG ("[%p] lock", context);
     g_mutex_lock (process_lock);
 
+    gboolean inprocess = context->state == INPROCESS;
+
     process_queue = g_slist_remove_link (process_queue, context->process_chunk);
     context->state = CLOSE;
+
+    while (process_current == context)
+        g_cond_wait (process_cond, process_lock);
+
     g_cond_broadcast (process_cond);
 
     g_mutex_unlock (process_lock);
     GST_DEBUG ("[%p] unlock", context);
+
+    if (inprocess) {
+        GstClockTime latency = monotonic_time () - cancel_at;
+
+        GST_DEBUG ("[%p] cancel latency %" GST_TIME_FORMAT, context,
+                GST_TIME_ARGS (latency));
+
+        g_mutex_lock (context->stats.lock);
+        context->stats.cancels += 1;
+        context->stats.cancel_latency = latency;
+        context->stats.cancel_latency_max =
+                MAX (context->stats.cancel_latency_max, latency);
+        g_mutex_unlock (context->stats.lock);
+    }
+}
+
+// stats -----------------------------------------------------------------------
+
+static gint compare_clock_time (gconstpointer a, gconstpointer b) {
+    GstClockTime x = *(const GstClockTime *) a;
+    GstClockTime y = *(const GstClockTime *) b;
+    return x < y ? -1 : x > y;
+}
+
+GstStructure *espeak_get_stats (Econtext * self) {
+    GstClockTime waits[STATS_WAIT_SIZE];
+    GstClockTime wait_p50 = 0, wait_p99 = 0;
+    gdouble realtime_factor = 0;
+
+    g_mutex_lock (self->stats.lock);
+
+    Estats *stats = &self->stats;
+    guint count = MIN (stats->queue_waits, STATS_WAIT_SIZE);
+
+    if (count) {
+        memcpy (waits, stats->queue_wait, count * sizeof (GstClockTime));
+        qsort (waits, count, sizeof (GstClockTime), compare_clock_time);
+        wait_p50 = waits[(count - 1) * 50 / 100];
+        wait_p99 = waits[(count - 1) * 99 / 100];
+    }
+
+    if (stats->synth_time && espeak_sample_rate)
+        realtime_factor = (gdouble) stats->samples / espeak_sample_rate /
+                ((gdouble) stats->synth_time / GST_SECOND);
+
+    GstStructure *data = gst_structure_new ("espeak-stats",
+            "time-to-first-audio", G_TYPE_UINT64, stats->first_audio,
+            "realtime-factor", G_TYPE_DOUBLE, realtime_factor,
+            "utterances", G_TYPE_UINT64, stats->utterances,
+            "samples", G_TYPE_UINT64, stats->samples,
+            "synths", G_TYPE_UINT64, stats->synths,
+            "synth-time", G_TYPE_UINT64, stats->synth_time,
+            "callbacks", G_TYPE_UINT64, stats->callbacks,
+            "callback-samples-max", G_TYPE_UINT64,
+            stats->callback_samples_max,
+            "voice-switches", G_TYPE_UINT64, stats->voice_switches,
+            "cached-segments", G_TYPE_UINT64, stats->cached_segments,
+            "replays", G_TYPE_UINT64, stats->replays,
+            "buffers", G_TYPE_UINT64, stats->buffers,
+            "buffer-bytes", G_TYPE_UINT64, stats->buffer_bytes,
+            "out-wait", G_TYPE_UINT64, stats->out_wait,
+            "underruns", G_TYPE_UINT64, stats->underruns,
+            "preemptions", G_TYPE_UINT64, stats->preemptions,
+            "cancels", G_TYPE_UINT64, stats->cancels,
+            "cancel-latency", G_TYPE_UINT64, stats->cancel_latency,
+            "cancel-latency-max", G_TYPE_UINT64, stats->cancel_latency_max,
+            "queue-wait-p50", G_TYPE_UINT64, wait_p50,
+            "queue-wait-p99", G_TYPE_UINT64, wait_p99, NULL);
+
+    g_mutex_unlock (self->stats.lock);
+
+    return data;
+}
+
+// backends --------------------------------------------------------------------
+
+static const Ebackend *select_backend () {
+    const gchar *name = g_getenv ("GST_ESPEAK_BACKEND");
+
+    if (name == NULL || strcmp (name, espeak_ng_backend.name) == 0)
+        return &espeak_ng_backend;
+    if (strcmp (name, fake_backend.name) == 0)
+        return &fake_backend;
+    if (strcmp (name, daemon_backend.name) == 0)
+        return &daemon_backend;
+
+    GST_WARNING ("unknown backend %s, fall back to %s", name,
+            espeak_ng_backend.name);
+    return &espeak_ng_backend;
 }
 
 // -----------------------------------------------------------------------------
@@ -577,16 +2187,24 @@ static void init () {
         process_cond = g_cond_new ();
         process_tid = g_thread_create (process, NULL, FALSE, NULL);
 
-        espeak_sample_rate = espeak_Initialize (AUDIO_OUTPUT_SYNCHRONOUS,
-                SYNC_BUFFER_SIZE_MS, NULL, 0);
+        backend = select_backend ();
+        GST_INFO ("use %s backend", backend->name);
+
+        espeak_sample_rate = backend->initialize (SYNC_BUFFER_SIZE_MS);
+        if (espeak_sample_rate <= 0 && backend != &espeak_ng_backend) {
+            GST_WARNING ("%s backend is not available, fall back to %s",
+                    backend->name, espeak_ng_backend.name);
+            backend = &espeak_ng_backend;
+            espeak_sample_rate = backend->initialize (SYNC_BUFFER_SIZE_MS);
+        }
         espeak_buffer_size =
                 (SYNC_BUFFER_SIZE_MS * espeak_sample_rate) /
                 1000 / BYTES_PER_SAMPLE;
-        espeak_SetSynthCallback (synth_cb);
+        backend->set_callback (synth_cb);
 
         gsize count = 0;
         const espeak_VOICE **i;
-        const espeak_VOICE **voices = espeak_ListVoices (NULL);
+        const espeak_VOICE **voices = backend->list_voices ();
 
         for (i = voices; *i; ++i)
             ++count;
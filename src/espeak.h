@@ -30,7 +30,9 @@ typedef struct _Econtext Econtext;
 const char* espeak_default_voice();
 Econtext *espeak_new (GstElement *);
 void espeak_unref (Econtext *);
+Econtext *espeak_prepare (Econtext *, const gchar * text);
 
+gint espeak_preload (const gchar * voices);
 gint espeak_get_sample_rate ();
 gint espeak_get_buffer_size ();
 GValueArray *espeak_get_voices ();
@@ -39,9 +41,36 @@ void espeak_set_rate (Econtext *, gint);
 void espeak_set_voice (Econtext *, const gchar *);
 void espeak_set_gap (Econtext *, guint);
 void espeak_set_track (Econtext *, guint);
+void espeak_set_stretch (Econtext *, gboolean);
+/* espeak_out() returns sound as soon as it is synthesized instead of
+ * whole chunks, while neither events are tracked nor sound stretched */
+void espeak_set_eager (Econtext *, gboolean);
+GstStructure *espeak_get_stats (Econtext *);
 
 void espeak_in (Econtext *, const gchar * str);
+void espeak_in_template (Econtext *, const gchar * str,
+        const GstStructure * slots);
 GstBuffer *espeak_out (Econtext *, gsize size_to_play);
+/* espeak_out() would return without waiting for synthesis */
+gboolean espeak_ready (Econtext *);
+gsize espeak_skip (Econtext *, GstClockTime position,
+        GstClockTime * gap_start, GstClockTime * gap_duration);
 void espeak_reset (Econtext *);
 
+/* random access to the whole utterance, espeak_render() waits until
+ * it is synthesized and returns its size in bytes */
+gsize espeak_render (Econtext *);
+gsize espeak_rendered_size (Econtext *);
+GstBuffer *espeak_range (Econtext *, guint64 offset, gsize size);
+
+/* recently spoken utterances, 0 is the last one, none are kept unless
+ * espeak_set_history_size() is called; espeak_replay() makes
+ * the range of characters [start, end) of it available to espeak_out()
+ * and espeak_range() without synthesizing it again, end <= start means
+ * up to the end of the utterance, returns the size in bytes */
+guint espeak_get_history_size (Econtext *);
+void espeak_set_history_size (Econtext *, guint);
+void espeak_inherit_history (Econtext *, Econtext * previous);
+gsize espeak_replay (Econtext *, guint utterance, guint start, guint end);
+
 #endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The espeak-ng engine, used by the element and by espeak-daemon.
+ */
+
+#include <glib.h>
+
+#include "backend.h"
+
+static gint espeak_ng_initialize (gint buffer_ms) {
+    return espeak_Initialize (AUDIO_OUTPUT_SYNCHRONOUS, buffer_ms, NULL, 0);
+}
+
+static const espeak_VOICE **espeak_ng_list_voices () {
+    return espeak_ListVoices (NULL);
+}
+
+static void espeak_ng_set_parameter (espeak_PARAMETER parameter, gint value) {
+    espeak_SetParameter (parameter, value, 0);
+}
+
+static void espeak_ng_set_voice (const gchar * voice) {
+    espeak_SetVoiceByName (voice);
+}
+
+static void espeak_ng_synth (const gchar * text, gsize size, guint flags,
+        gpointer user_data) {
+    espeak_Synth (text, size, 0, POS_CHARACTER, 0, flags, NULL, user_data);
+}
+
+const Ebackend espeak_ng_backend = {
+    "espeak-ng",
+    espeak_ng_initialize,
+    espeak_SetSynthCallback,
+    espeak_ng_list_voices,
+    espeak_ng_set_parameter,
+    espeak_ng_set_voice,
+    espeak_ng_synth
+};
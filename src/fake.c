@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Deterministic engine which doesn't do any DSP, to measure the element's
+ * own overhead. Every word of the text lasts "word" ms and is rendered as
+ * a triangle tone (or silence), sound is delivered "speed" times faster
+ * than realtime (0 means as fast as possible). Configured by
+ * GST_ESPEAK_FAKE, e.g. "speed=10000,word=250,rate=22050,pcm=silence".
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "backend.h"
+
+#define FAKE_TONE_HZ 220
+#define FAKE_AMPLITUDE 4096
+
+static gint fake_rate = 22050;
+static gint fake_word_ms = 250;
+static gint fake_speed = 0;
+static gboolean fake_silence = FALSE;
+static gint fake_buffer_ms = 200;
+static t_espeak_callback *fake_callback = NULL;
+
+static char fake_languages[] = "\005en-us\0";
+static espeak_VOICE fake_voice = { "fake", fake_languages, "fake" };
+static const espeak_VOICE *fake_voices[] = { &fake_voice, NULL };
+
+static gint fake_initialize (gint buffer_ms) {
+    const gchar *config = g_getenv ("GST_ESPEAK_FAKE");
+
+    fake_buffer_ms = buffer_ms;
+
+    if (config) {
+        gchar **options = g_strsplit (config, ",", -1);
+        gchar **i;
+
+        for (i = options; *i; ++i) {
+            gchar *value = strchr (*i, '=');
+            if (value == NULL)
+                continue;
+            *value++ = 0;
+
+            if (strcmp (*i, "speed") == 0)
+                fake_speed = MAX (0, atoi (value));
+            else if (strcmp (*i, "word") == 0)
+                fake_word_ms = MAX (1, atoi (value));
+            else if (strcmp (*i, "rate") == 0)
+                fake_rate = MAX (1000, atoi (value));
+            else if (strcmp (*i, "pcm") == 0)
+                fake_silence = strcmp (value, "silence") == 0;
+            else
+                GST_WARNING ("unknown fake engine option %s", *i);
+        }
+
+        g_strfreev (options);
+    }
+
+    GST_INFO ("speed=%d word=%d rate=%d silence=%d", fake_speed,
+            fake_word_ms, fake_rate, fake_silence);
+
+    return fake_rate;
+}
+
+static void fake_set_callback (t_espeak_callback * callback) {
+    fake_callback = callback;
+}
+
+static const espeak_VOICE **fake_list_voices () {
+    return fake_voices;
+}
+
+static void fake_set_parameter (espeak_PARAMETER parameter, gint value) {
+}
+
+static void fake_set_voice (const gchar * voice) {
+}
+
+static void add_event (GArray * events, espeak_EVENT_TYPE type, gint sample,
+        gint text_position, gpointer user_data) {
+    espeak_EVENT event = { type };
+
+    event.sample = sample;
+    event.audio_position = (gint64) sample * 1000 / fake_rate;
+    event.text_position = text_position;
+    event.user_data = user_data;
+
+    g_array_append_val (events, event);
+}
+
+static void end_word (GArray * events, gint * word, gint * sample,
+        gint word_samples, gint pos) {
+    if (*word < 0)
+        return;
+
+    espeak_EVENT *i = &g_array_index (events, espeak_EVENT, *word);
+    i->length = pos - i->text_position;
+    *sample += word_samples;
+    *word = -1;
+}
+
+// plan events for the whole text, espeak reports 1-based character positions
+static GArray *fake_events (const gchar * text, gsize size, guint flags,
+        gpointer user_data) {
+    GArray *events = g_array_new (FALSE, FALSE, sizeof (espeak_EVENT));
+    gint word_samples = (gint64) fake_word_ms * fake_rate / 1000;
+    gint sample = 0;
+    gint word = -1;
+    gint words = 0;
+    gint sentences = 0;
+    gboolean sentence_end = TRUE;
+    const gchar *end = text + size;
+    const gchar *i;
+    gint pos;
+
+    for (i = text, pos = 1; i < end && *i; i = g_utf8_next_char (i), ++pos) {
+        gunichar c = g_utf8_get_char (i);
+
+        if (c == '<' && (flags & espeakSSML)) {
+            const gchar *tag_end = strchr (i, '>');
+            if (tag_end == NULL)
+                break;
+
+            end_word (events, &word, &sample, word_samples, pos);
+
+            if (strncmp (i, "<mark", 5) == 0) {
+                const gchar *name = strstr (i, "name=\"");
+                if (name && name < tag_end) {
+                    name += 6;
+                    const gchar *name_end = strchr (name, '"');
+                    if (name_end && name_end < tag_end) {
+                        add_event (events, espeakEVENT_MARK, sample, pos,
+                                user_data);
+                        g_array_index (events, espeak_EVENT,
+                                events->len - 1).id.name =
+                                g_strndup (name, name_end - name);
+                    }
+                }
+            }
+
+            pos += g_utf8_strlen (i, tag_end - i);
+            i = tag_end;
+            continue;
+        }
+
+        if (g_unichar_isspace (c)) {
+            end_word (events, &word, &sample, word_samples, pos);
+            continue;
+        }
+
+        if (word < 0) {
+            if (sentence_end) {
+                add_event (events, espeakEVENT_SENTENCE, sample, pos,
+                        user_data);
+                g_array_index (events, espeak_EVENT, events->len - 1).id.number
+                        = ++sentences;
+            }
+            add_event (events, espeakEVENT_WORD, sample, pos, user_data);
+            g_array_index (events, espeak_EVENT, events->len - 1).id.number =
+                    ++words;
+            word = events->len - 1;
+        }
+
+        sentence_end = c == '.' || c == '!' || c == '?';
+    }
+
+    end_word (events, &word, &sample, word_samples, pos);
+
+    add_event (events, espeakEVENT_MSG_TERMINATED, sample, pos, user_data);
+
+    return events;
+}
+
+static void fake_pcm (short *data, gint offset, gint count) {
+    gint period = MAX (2, fake_rate / FAKE_TONE_HZ);
+    gint i;
+
+    if (fake_silence) {
+        memset (data, 0, count * sizeof (short));
+        return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        gint phase = (offset + i) % period;
+        data[i] = FAKE_AMPLITUDE * (ABS (phase * 4 - period * 2) - period) /
+                period;
+    }
+}
+
+static void fake_synth (const gchar * text, gsize size, guint flags,
+        gpointer user_data) {
+    GArray *events = fake_events (text, size, flags, user_data);
+    espeak_EVENT *last = &g_array_index (events, espeak_EVENT,
+            events->len - 1);
+    gint total = last->sample;
+    gint chunk = MAX (1, fake_buffer_ms * fake_rate / 1000);
+    short *data = g_new (short, chunk);
+    GArray *chunk_events = g_array_new (FALSE, FALSE, sizeof (espeak_EVENT));
+    espeak_EVENT terminator = { espeakEVENT_LIST_TERMINATED };
+    gint64 start = g_get_monotonic_time ();
+    guint event = 0;
+    gint offset;
+
+    terminator.user_data = user_data;
+
+    for (offset = 0; offset < total || event < events->len; offset += chunk) {
+        gint count = CLAMP (total - offset, 0, chunk);
+
+        g_array_set_size (chunk_events, 0);
+        for (; event < events->len; ++event) {
+            espeak_EVENT *i = &g_array_index (events, espeak_EVENT, event);
+            if (i->sample >= offset + count && offset + count < total)
+                break;
+            g_array_append_val (chunk_events, *i);
+        }
+        g_array_append_val (chunk_events, terminator);
+
+        fake_pcm (data, offset, count);
+
+        if (fake_speed) {
+            gint64 due = start + (gint64) (offset + count) * G_USEC_PER_SEC /
+                    fake_rate / fake_speed;
+            gint64 now = g_get_monotonic_time ();
+            if (due > now)
+                g_usleep (due - now);
+        }
+
+        if (fake_callback (data, count, (espeak_EVENT *) chunk_events->data))
+            break;
+    }
+
+    fake_callback (NULL, 0, &terminator);
+
+    for (event = 0; event < events->len; ++event) {
+        espeak_EVENT *i = &g_array_index (events, espeak_EVENT, event);
+        if (i->type == espeakEVENT_MARK)
+            g_free ((gchar *) i->id.name);
+    }
+
+    g_array_free (chunk_events, TRUE);
+    g_array_free (events, TRUE);
+    g_free (data);
+}
+
+const Ebackend fake_backend = {
+    "fake",
+    fake_initialize,
+    fake_set_callback,
+    fake_list_voices,
+    fake_set_parameter,
+    fake_set_voice,
+    fake_synth
+};
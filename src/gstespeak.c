@@ -38,11 +38,17 @@
 #include <string.h>
 
 #include "gstespeak.h"
+#include "gstespeakmix.h"
 #include "espeak.h"
 
 GST_DEBUG_CATEGORY_STATIC (gst_espeak_debug);
 #define GST_CAT_DEFAULT gst_espeak_debug
 
+// skipping speech is up to the application, e.g. 200 ms for live prompts
+#define DEFAULT_QOS_THRESHOLD 0
+#define DEFAULT_INITIAL_BUFFER_TIME (20 * GST_MSECOND)
+#define DEFAULT_MAX_BUFFER_TIME (200 * GST_MSECOND)
+
 enum {
     PROP_0,
     PROP_TEXT,
@@ -52,9 +58,30 @@ enum {
     PROP_GAP,
     PROP_TRACK,
     PROP_VOICES,
-    PROP_CAPS
+    PROP_CAPS,
+    PROP_QOS_THRESHOLD,
+    PROP_SKIPPED_SAMPLES,
+    PROP_STATS,
+    PROP_STRETCH,
+    PROP_SLOTS,
+    PROP_RANDOM_ACCESS,
+    PROP_ADAPTIVE,
+    PROP_INITIAL_BUFFER_TIME,
+    PROP_MAX_BUFFER_TIME,
+    PROP_HISTORY_SIZE
 };
 
+enum {
+    SIGNAL_PREPARE,
+    SIGNAL_PLAY,
+    SIGNAL_DISCARD,
+    SIGNAL_REPLAY,
+    SIGNAL_PRELOAD,
+    LAST_SIGNAL
+};
+
+static guint gst_espeak_signals[LAST_SIGNAL] = { 0 };
+
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
         GST_PAD_SRC,
         GST_PAD_ALWAYS,
@@ -65,12 +92,25 @@ static GstFlowReturn gst_espeak_create (GstBaseSrc *,
 static gboolean gst_espeak_start (GstBaseSrc *);
 static gboolean gst_espeak_stop (GstBaseSrc *);
 static gboolean gst_espeak_is_seekable (GstBaseSrc *);
+static gboolean gst_espeak_get_size (GstBaseSrc *, guint64 *);
+static gboolean gst_espeak_prepare_seek_segment (GstBaseSrc *, GstEvent *,
+        GstSegment *);
+static gboolean gst_espeak_query (GstBaseSrc *, GstQuery *);
+static gboolean gst_espeak_event (GstBaseSrc *, GstEvent *);
+static gboolean gst_espeak_convert (GstEspeak *, GstFormat, gint64,
+        GstFormat, gint64 *);
 static void gst_espeak_uri_handler_init (gpointer g_iface, gpointer iface_data);
 static void gst_espeak_finalize (GObject *);
 static void gst_espeak_set_property (GObject *, guint, const GValue *,
         GParamSpec *);
 static void gst_espeak_get_property (GObject *, guint, GValue *, GParamSpec *);
 static GstCaps *gst_espeak_getcaps (GstBaseSrc *, GstCaps *);
+static guint gst_espeak_prepare (GstEspeak *, const gchar *);
+static gboolean gst_espeak_play (GstEspeak *, guint);
+static gboolean gst_espeak_discard (GstEspeak *, guint);
+static gboolean gst_espeak_replay (GstEspeak *, guint, guint, guint);
+static gint gst_espeak_preload (GstEspeak *, const gchar *);
+static gpointer gst_espeak_preload_thread (gpointer);
 
 G_DEFINE_TYPE_WITH_CODE (GstEspeak, gst_espeak, GST_TYPE_BASE_SRC,
         G_IMPLEMENT_INTERFACE (GST_TYPE_URI_HANDLER,
@@ -88,12 +128,22 @@ static void gst_espeak_class_init (GstEspeakClass * klass) {
     basesrc_class->start = gst_espeak_start;
     basesrc_class->stop = gst_espeak_stop;
     basesrc_class->is_seekable = gst_espeak_is_seekable;
+    basesrc_class->get_size = gst_espeak_get_size;
+    basesrc_class->prepare_seek_segment = gst_espeak_prepare_seek_segment;
+    basesrc_class->query = gst_espeak_query;
     basesrc_class->get_caps = gst_espeak_getcaps;
+    basesrc_class->event = gst_espeak_event;
 
     gobject_class->finalize = gst_espeak_finalize;
     gobject_class->set_property = gst_espeak_set_property;
     gobject_class->get_property = gst_espeak_get_property;
 
+    klass->prepare = gst_espeak_prepare;
+    klass->play = gst_espeak_play;
+    klass->discard = gst_espeak_discard;
+    klass->replay = gst_espeak_replay;
+    klass->preload = gst_espeak_preload;
+
     g_object_class_install_property (gobject_class, PROP_TEXT,
             g_param_spec_string ("text", "Text",
                     "Text to pronounce", NULL,
@@ -126,6 +176,92 @@ static void gst_espeak_class_init (GstEspeakClass * klass) {
             g_param_spec_boxed ("caps", "Caps",
                     "Caps describing the format of the data", GST_TYPE_CAPS,
                     G_PARAM_READABLE));
+    g_object_class_install_property (gobject_class, PROP_QOS_THRESHOLD,
+            g_param_spec_uint64 ("qos-threshold", "QoS threshold",
+                    "Skip to the next word or sentence when downstream "
+                    "reports being late by more than this (in ns, 0=disable, "
+                    "the default)",
+                    0, G_MAXUINT64, DEFAULT_QOS_THRESHOLD,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_SKIPPED_SAMPLES,
+            g_param_spec_uint64 ("skipped-samples", "Skipped samples",
+                    "Number of samples skipped because of QoS lateness",
+                    0, G_MAXUINT64, 0,
+                    G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_STRETCH,
+            g_param_spec_boolean ("stretch", "Stretch",
+                    "Apply rate changes to already synthesized sound by "
+                    "time-stretching it", FALSE,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_SLOTS,
+            g_param_spec_boxed ("slots", "Slots",
+                    "Values for {name} markers in text, static parts of the "
+                    "text are synthesized once and reused", GST_TYPE_STRUCTURE,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_RANDOM_ACCESS,
+            g_param_spec_boolean ("random-access", "Random access",
+                    "Synthesize the whole text on start and operate in "
+                    "bytes, allowing pull mode and seeking", FALSE,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_ADAPTIVE,
+            g_param_spec_boolean ("adaptive", "Adaptive buffers",
+                    "Start every utterance with initial-buffer-time buffers "
+                    "as soon as their sound is synthesized and grow them up "
+                    "to max-buffer-time while downstream has enough sound "
+                    "queued", FALSE,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_INITIAL_BUFFER_TIME,
+            g_param_spec_uint64 ("initial-buffer-time", "Initial buffer time",
+                    "Duration of the first buffer in adaptive mode (in ns)",
+                    GST_MSECOND, G_MAXUINT64, DEFAULT_INITIAL_BUFFER_TIME,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_MAX_BUFFER_TIME,
+            g_param_spec_uint64 ("max-buffer-time", "Maximum buffer time",
+                    "Largest buffer duration in adaptive mode (in ns)",
+                    GST_MSECOND, G_MAXUINT64, DEFAULT_MAX_BUFFER_TIME,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_HISTORY_SIZE,
+            g_param_spec_uint ("history-size", "History size",
+                    "Number of spoken utterances kept for \"replay\"",
+                    0, 64, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_STATS,
+            g_param_spec_boxed ("stats", "Statistics",
+                    "Synthesis and streaming statistics", GST_TYPE_STRUCTURE,
+                    G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    /* synthesize text in background and return a handle for "play" */
+    gst_espeak_signals[SIGNAL_PREPARE] =
+            g_signal_new ("prepare", G_TYPE_FROM_CLASS (klass),
+            G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+            G_STRUCT_OFFSET (GstEspeakClass, prepare), NULL, NULL, NULL,
+            G_TYPE_UINT, 1, G_TYPE_STRING);
+    /* speak prepared utterance on next start instead of "text" */
+    gst_espeak_signals[SIGNAL_PLAY] =
+            g_signal_new ("play", G_TYPE_FROM_CLASS (klass),
+            G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+            G_STRUCT_OFFSET (GstEspeakClass, play), NULL, NULL, NULL,
+            G_TYPE_BOOLEAN, 1, G_TYPE_UINT);
+    gst_espeak_signals[SIGNAL_DISCARD] =
+            g_signal_new ("discard", G_TYPE_FROM_CLASS (klass),
+            G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+            G_STRUCT_OFFSET (GstEspeakClass, discard), NULL, NULL, NULL,
+            G_TYPE_BOOLEAN, 1, G_TYPE_UINT);
+    /* speak characters [start, end) of a recently spoken utterance, 0 is
+     * the last one, on next start without synthesizing it again; needs
+     * history-size */
+    gst_espeak_signals[SIGNAL_REPLAY] =
+            g_signal_new ("replay", G_TYPE_FROM_CLASS (klass),
+            G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+            G_STRUCT_OFFSET (GstEspeakClass, replay), NULL, NULL, NULL,
+            G_TYPE_BOOLEAN, 3, G_TYPE_UINT, G_TYPE_UINT, G_TYPE_UINT);
+    /* load comma separated voices and warm up the engine, returns the
+     * number of voices and posts an "espeak-preloaded" message once they
+     * are ready */
+    gst_espeak_signals[SIGNAL_PRELOAD] =
+            g_signal_new ("preload", G_TYPE_FROM_CLASS (klass),
+            G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+            G_STRUCT_OFFSET (GstEspeakClass, preload), NULL, NULL, NULL,
+            G_TYPE_INT, 1, G_TYPE_STRING);
 
     gst_element_class_add_pad_template (element_class,
             gst_static_pad_template_get (&src_factory));
@@ -149,6 +285,18 @@ static void gst_espeak_init (GstEspeak * self) {
     self->voice = g_strdup (espeak_default_voice ());
     self->voices = espeak_get_voices ();
     self->speak = espeak_new (GST_ELEMENT (self));
+    self->qos_threshold = DEFAULT_QOS_THRESHOLD;
+    self->adaptive = FALSE;
+    self->initial_buffer_time = DEFAULT_INITIAL_BUFFER_TIME;
+    self->max_buffer_time = DEFAULT_MAX_BUFFER_TIME;
+    self->qos_position = GST_CLOCK_TIME_NONE;
+    self->skipped_samples = 0;
+    self->prepared = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+            NULL, (GDestroyNotify) espeak_unref);
+    self->prepared_handle = 0;
+    self->next_speak = NULL;
+    self->history_size = 0;
+    self->replay = FALSE;
 
     GstAudioFormat format;
     format = gst_audio_format_build_integer (TRUE, G_BYTE_ORDER, 16, 16);
@@ -161,6 +309,18 @@ static void gst_espeak_init (GstEspeak * self) {
 
     gst_base_src_set_format (GST_BASE_SRC (self), GST_FORMAT_TIME);
     gst_base_src_set_blocksize (GST_BASE_SRC (self), espeak_get_buffer_size());
+
+    /* the first element warms up voices for the whole process in the
+     * background, e.g. GST_ESPEAK_PRELOAD="en,de", and posts
+     * "espeak-preloaded" when done */
+    static volatile gsize preloaded = 0;
+    if (g_once_init_enter (&preloaded)) {
+        const gchar *voices = g_getenv ("GST_ESPEAK_PRELOAD");
+        if (voices && *voices)
+            g_thread_create (gst_espeak_preload_thread, gst_object_ref (self),
+                    FALSE, NULL);
+        g_once_init_leave (&preloaded, 1);
+    }
 }
 
 static void gst_espeak_finalize (GObject * self_) {
@@ -168,10 +328,18 @@ static void gst_espeak_finalize (GObject * self_) {
 
     g_free (self->text);
     self->text = NULL;
+    if (self->slots)
+        gst_structure_free (self->slots);
+    self->slots = NULL;
     gst_caps_unref (self->caps);
     self->caps = NULL;
     espeak_unref (self->speak);
     self->speak = NULL;
+    g_hash_table_destroy (self->prepared);
+    self->prepared = NULL;
+    if (self->next_speak)
+        espeak_unref (self->next_speak);
+    self->next_speak = NULL;
     g_free (self->voice);
     self->voice = NULL;
     g_value_array_free (self->voices);
@@ -197,24 +365,79 @@ gst_espeak_set_property (GObject * object, guint prop_id,
         gst_espeak_set_text (self, g_value_get_string (value));
         break;
     case PROP_PITCH:
+        GST_OBJECT_LOCK (self);
         self->pitch = g_value_get_int (value);
         espeak_set_pitch (self->speak, self->pitch);
+        GST_OBJECT_UNLOCK (self);
         break;
     case PROP_RATE:
+        GST_OBJECT_LOCK (self);
         self->rate = g_value_get_int (value);
         espeak_set_rate (self->speak, self->rate);
+        GST_OBJECT_UNLOCK (self);
         break;
     case PROP_VOICE:
+        GST_OBJECT_LOCK (self);
         self->voice = g_strdup (g_value_get_string (value));
         espeak_set_voice (self->speak, self->voice);
+        GST_OBJECT_UNLOCK (self);
         break;
     case PROP_GAP:
+        GST_OBJECT_LOCK (self);
         self->gap = g_value_get_uint (value);
         espeak_set_gap (self->speak, self->gap);
+        GST_OBJECT_UNLOCK (self);
         break;
     case PROP_TRACK:
+        GST_OBJECT_LOCK (self);
         self->track = g_value_get_uint (value);
         espeak_set_track (self->speak, self->track);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_STRETCH:
+        GST_OBJECT_LOCK (self);
+        self->stretch = g_value_get_boolean (value);
+        espeak_set_stretch (self->speak, self->stretch);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_RANDOM_ACCESS:
+        self->random_access = g_value_get_boolean (value);
+        gst_base_src_set_format (GST_BASE_SRC (self), self->random_access ?
+                GST_FORMAT_BYTES : GST_FORMAT_TIME);
+        break;
+    case PROP_SLOTS:
+        GST_OBJECT_LOCK (self);
+        if (self->slots)
+            gst_structure_free (self->slots);
+        self->slots = g_value_dup_boxed (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_QOS_THRESHOLD:
+        GST_OBJECT_LOCK (self);
+        self->qos_threshold = g_value_get_uint64 (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_ADAPTIVE:
+        GST_OBJECT_LOCK (self);
+        self->adaptive = g_value_get_boolean (value);
+        espeak_set_eager (self->speak, self->adaptive);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_INITIAL_BUFFER_TIME:
+        GST_OBJECT_LOCK (self);
+        self->initial_buffer_time = g_value_get_uint64 (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_MAX_BUFFER_TIME:
+        GST_OBJECT_LOCK (self);
+        self->max_buffer_time = g_value_get_uint64 (value);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_HISTORY_SIZE:
+        GST_OBJECT_LOCK (self);
+        self->history_size = g_value_get_uint (value);
+        espeak_set_history_size (self->speak, self->history_size);
+        GST_OBJECT_UNLOCK (self);
         break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -232,19 +455,42 @@ gst_espeak_get_property (GObject * object, guint prop_id,
         g_value_set_string (value, self->text);
         break;
     case PROP_PITCH:
+        GST_OBJECT_LOCK (self);
         g_value_set_int (value, self->pitch);
+        GST_OBJECT_UNLOCK (self);
         break;
     case PROP_RATE:
+        GST_OBJECT_LOCK (self);
         g_value_set_int (value, self->rate);
+        GST_OBJECT_UNLOCK (self);
         break;
     case PROP_VOICE:
+        GST_OBJECT_LOCK (self);
         g_value_set_string (value, self->voice);
+        GST_OBJECT_UNLOCK (self);
         break;
     case PROP_GAP:
+        GST_OBJECT_LOCK (self);
         g_value_set_uint (value, self->gap);
+        GST_OBJECT_UNLOCK (self);
         break;
     case PROP_TRACK:
+        GST_OBJECT_LOCK (self);
         g_value_set_uint (value, self->track);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_STRETCH:
+        GST_OBJECT_LOCK (self);
+        g_value_set_boolean (value, self->stretch);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_RANDOM_ACCESS:
+        g_value_set_boolean (value, self->random_access);
+        break;
+    case PROP_SLOTS:
+        GST_OBJECT_LOCK (self);
+        g_value_set_boxed (value, self->slots);
+        GST_OBJECT_UNLOCK (self);
         break;
     case PROP_VOICES:
         g_value_set_boxed (value, self->voices);
@@ -252,6 +498,41 @@ gst_espeak_get_property (GObject * object, guint prop_id,
     case PROP_CAPS:
         gst_value_set_caps (value, self->caps);
         break;
+    case PROP_QOS_THRESHOLD:
+        GST_OBJECT_LOCK (self);
+        g_value_set_uint64 (value, self->qos_threshold);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_ADAPTIVE:
+        GST_OBJECT_LOCK (self);
+        g_value_set_boolean (value, self->adaptive);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_INITIAL_BUFFER_TIME:
+        GST_OBJECT_LOCK (self);
+        g_value_set_uint64 (value, self->initial_buffer_time);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_MAX_BUFFER_TIME:
+        GST_OBJECT_LOCK (self);
+        g_value_set_uint64 (value, self->max_buffer_time);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_HISTORY_SIZE:
+        GST_OBJECT_LOCK (self);
+        g_value_set_uint (value, self->history_size);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_SKIPPED_SAMPLES:
+        GST_OBJECT_LOCK (self);
+        g_value_set_uint64 (value, self->skipped_samples);
+        GST_OBJECT_UNLOCK (self);
+        break;
+    case PROP_STATS:
+        GST_OBJECT_LOCK (self);
+        g_value_take_boxed (value, espeak_get_stats (self->speak));
+        GST_OBJECT_UNLOCK (self);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -260,15 +541,108 @@ gst_espeak_get_property (GObject * object, guint prop_id,
 
 /******************************************************************************/
 
+// time downstream has queued once buf is pushed, or GST_CLOCK_TIME_NONE
+// while there is no clock running
+static GstClockTime gst_espeak_cushion (GstEspeak * self, GstBuffer * buf) {
+    GstElement *element = GST_ELEMENT (self);
+
+    if (GST_STATE (element) != GST_STATE_PLAYING)
+        return GST_CLOCK_TIME_NONE;
+
+    GstClock *clock = gst_element_get_clock (element);
+    if (clock == NULL)
+        return GST_CLOCK_TIME_NONE;
+
+    GstClockTime now = gst_clock_get_time (clock) -
+            gst_element_get_base_time (element);
+    gst_object_unref (clock);
+
+    GstClockTime end = gst_segment_to_running_time (&GST_BASE_SRC
+            (self)->segment, GST_FORMAT_TIME, GST_BUFFER_TIMESTAMP (buf) +
+            GST_BUFFER_DURATION (buf));
+
+    if (!GST_CLOCK_TIME_IS_VALID (end))
+        return GST_CLOCK_TIME_NONE;
+
+    return end > now ? end - now : 0;
+}
+
+// double the buffer duration while downstream has more than two buffers
+// queued, halve it when less than one is left
+static void gst_espeak_adapt (GstEspeak * self, GstBuffer * buf) {
+    GstClockTime cushion = gst_espeak_cushion (self, buf);
+
+    GST_OBJECT_LOCK (self);
+    GstClockTime initial = self->initial_buffer_time;
+    GstClockTime max = MAX (self->max_buffer_time, initial);
+    GstClockTime time = self->buffer_time;
+
+    if (!GST_CLOCK_TIME_IS_VALID (cushion) || cushion > 2 * time)
+        time = MIN (time * 2, max);
+    else if (cushion < time)
+        time = MAX (time / 2, initial);
+
+    self->buffer_time = time;
+    GST_OBJECT_UNLOCK (self);
+
+    GST_LOG_OBJECT (self, "cushion %" GST_TIME_FORMAT " buffer %"
+            GST_TIME_FORMAT, GST_TIME_ARGS (cushion), GST_TIME_ARGS (time));
+}
+
 static GstFlowReturn
 gst_espeak_create (GstBaseSrc * self_, guint64 offset, guint size,
         GstBuffer ** buffer) {
     GstEspeak *self = GST_ESPEAK (self_);
     GstBuffer *buf;
 
+    if (self->random_access) {
+        buf = espeak_range (self->speak, offset, size);
+        if (buf == NULL)
+            return GST_FLOW_EOS;
+        *buffer = buf;
+        return GST_FLOW_OK;
+    }
+
+    GST_OBJECT_LOCK (self);
+    GstClockTime qos_position = self->qos_position;
+    self->qos_position = GST_CLOCK_TIME_NONE;
+    gboolean adaptive = self->adaptive;
+    GstClockTime buffer_time = self->buffer_time;
+    GST_OBJECT_UNLOCK (self);
+
+    if (adaptive) {
+        gint64 bytes;
+        if (gst_espeak_convert (self, GST_FORMAT_TIME, buffer_time,
+                        GST_FORMAT_BYTES, &bytes) && bytes > 1)
+            size = bytes & ~1;
+    }
+
+    // QoS reports running time, buffers are timestamped in stream time
+    if (GST_CLOCK_TIME_IS_VALID (qos_position))
+        qos_position = gst_segment_position_from_running_time
+                (&self_->segment, GST_FORMAT_TIME, qos_position);
+
+    if (GST_CLOCK_TIME_IS_VALID (qos_position)) {
+        GstClockTime gap_start, gap_duration;
+        gsize skipped = espeak_skip (self->speak, qos_position,
+                &gap_start, &gap_duration);
+
+        if (skipped) {
+            GST_INFO_OBJECT (self, "late, skipped %" G_GSIZE_FORMAT
+                    " samples", skipped);
+            GST_OBJECT_LOCK (self);
+            self->skipped_samples += skipped;
+            GST_OBJECT_UNLOCK (self);
+            gst_pad_push_event (GST_BASE_SRC_PAD (self_),
+                    gst_event_new_gap (gap_start, gap_duration));
+        }
+    }
+
     buf = espeak_out (self->speak, size);
 
     if (buf) {
+        if (adaptive)
+            gst_espeak_adapt (self, buf);
         *buffer = buf;
         return GST_FLOW_OK;
     } else
@@ -278,7 +652,64 @@ gst_espeak_create (GstBaseSrc * self_, guint64 offset, guint size,
 static gboolean gst_espeak_start (GstBaseSrc * self_) {
     GST_DEBUG ("gst_espeak_start");
     GstEspeak *self = GST_ESPEAK (self_);
-    espeak_in (self->speak, self->text);
+
+    GST_OBJECT_LOCK (self);
+    self->qos_position = GST_CLOCK_TIME_NONE;
+    self->buffer_time = self->initial_buffer_time;
+    gboolean replay = self->replay;
+    guint utterance = self->replay_utterance;
+    guint start = self->replay_start;
+    guint end = self->replay_end;
+    self->replay = FALSE;
+    GST_OBJECT_UNLOCK (self);
+
+    gboolean replayed = replay &&
+            espeak_replay (self->speak, utterance, start, end) > 0;
+
+    GST_OBJECT_LOCK (self);
+    struct _Econtext *prepared = replayed ? NULL : self->next_speak;
+    if (prepared)
+        self->next_speak = NULL;
+    GST_OBJECT_UNLOCK (self);
+
+    if (replayed) {
+        GST_DEBUG_OBJECT (self, "replay %u [%u, %u)", utterance, start, end);
+    } else if (prepared) {
+        // take over prepared context with its already synthesized sound,
+        // property setters and actions use self->speak under the lock
+        GST_OBJECT_LOCK (self);
+        struct _Econtext *previous = self->speak;
+        self->speak = prepared;
+        espeak_set_pitch (self->speak, self->pitch);
+        espeak_set_rate (self->speak, self->rate);
+        espeak_set_voice (self->speak, self->voice);
+        espeak_set_gap (self->speak, self->gap);
+        espeak_set_track (self->speak, self->track);
+        espeak_set_stretch (self->speak, self->stretch);
+        espeak_set_eager (self->speak, self->adaptive);
+        espeak_set_history_size (self->speak, self->history_size);
+        GST_OBJECT_UNLOCK (self);
+
+        espeak_inherit_history (prepared, previous);
+        espeak_unref (previous);
+    } else {
+        GST_OBJECT_LOCK (self);
+        GstStructure *slots = self->slots ? gst_structure_copy (self->slots)
+                : NULL;
+        GST_OBJECT_UNLOCK (self);
+
+        if (slots) {
+            espeak_in_template (self->speak, self->text, slots);
+            gst_structure_free (slots);
+        } else
+            espeak_in (self->speak, self->text);
+    }
+
+    if (self->random_access && !replayed) {
+        gsize size = espeak_render (self->speak);
+        GST_DEBUG_OBJECT (self, "rendered %" G_GSIZE_FORMAT " bytes", size);
+    }
+
     gst_base_src_set_caps (self_, self->caps);
     return TRUE;
 }
@@ -290,8 +721,116 @@ static gboolean gst_espeak_stop (GstBaseSrc * self_) {
     return TRUE;
 }
 
-static gboolean gst_espeak_is_seekable (GstBaseSrc * src) {
-    return FALSE;
+static gboolean gst_espeak_is_seekable (GstBaseSrc * self_) {
+    return GST_ESPEAK (self_)->random_access;
+}
+
+static gboolean gst_espeak_get_size (GstBaseSrc * self_, guint64 * size) {
+    GstEspeak *self = GST_ESPEAK (self_);
+
+    if (!self->random_access)
+        return FALSE;
+
+    *size = espeak_rendered_size (self->speak);
+    return TRUE;
+}
+
+static gboolean gst_espeak_convert (GstEspeak * self, GstFormat src_format,
+        gint64 src_value, GstFormat dest_format, gint64 * dest_value) {
+    GstAudioInfo info;
+
+    if (!gst_audio_info_from_caps (&info, self->caps))
+        return FALSE;
+
+    return gst_audio_info_convert (&info, src_format, src_value, dest_format,
+            dest_value);
+}
+
+// seeks in time are mapped to bytes of the rendered utterance
+static gboolean gst_espeak_prepare_seek_segment (GstBaseSrc * self_,
+        GstEvent * seek, GstSegment * segment) {
+    GstEspeak *self = GST_ESPEAK (self_);
+    gdouble rate;
+    GstFormat format;
+    GstSeekFlags flags;
+    GstSeekType start_type, stop_type;
+    gint64 start, stop;
+
+    gst_event_parse_seek (seek, &rate, &format, &flags, &start_type, &start,
+            &stop_type, &stop);
+
+    if (format == segment->format)
+        return GST_BASE_SRC_CLASS (gst_espeak_parent_class)->
+                prepare_seek_segment (self_, seek, segment);
+
+    if (start_type != GST_SEEK_TYPE_NONE && start != -1 &&
+            !gst_espeak_convert (self, format, start, segment->format, &start))
+        return FALSE;
+    if (stop_type != GST_SEEK_TYPE_NONE && stop != -1 &&
+            !gst_espeak_convert (self, format, stop, segment->format, &stop))
+        return FALSE;
+
+    return gst_segment_do_seek (segment, rate, segment->format, flags,
+            start_type, start, stop_type, stop, NULL);
+}
+
+static gboolean gst_espeak_query (GstBaseSrc * self_, GstQuery * query) {
+    GstEspeak *self = GST_ESPEAK (self_);
+
+    switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CONVERT:{
+        GstFormat src_format, dest_format;
+        gint64 src_value, dest_value;
+
+        gst_query_parse_convert (query, &src_format, &src_value,
+                &dest_format, NULL);
+        if (!gst_espeak_convert (self, src_format, src_value, dest_format,
+                        &dest_value))
+            return FALSE;
+        gst_query_set_convert (query, src_format, src_value, dest_format,
+                dest_value);
+        return TRUE;
+    }
+    case GST_QUERY_DURATION:{
+        GstFormat format;
+        gint64 duration;
+
+        gst_query_parse_duration (query, &format, NULL);
+        if (!self->random_access || format == GST_FORMAT_BYTES)
+            break;
+        if (!gst_espeak_convert (self, GST_FORMAT_BYTES,
+                        espeak_rendered_size (self->speak), format, &duration))
+            return FALSE;
+        gst_query_set_duration (query, format, duration);
+        return TRUE;
+    }
+    default:
+        break;
+    }
+
+    return GST_BASE_SRC_CLASS (gst_espeak_parent_class)->query (self_, query);
+}
+
+static gboolean gst_espeak_event (GstBaseSrc * self_, GstEvent * event) {
+    GstEspeak *self = GST_ESPEAK (self_);
+
+    if (GST_EVENT_TYPE (event) == GST_EVENT_QOS) {
+        GstQOSType type;
+        gdouble proportion;
+        GstClockTimeDiff diff;
+        GstClockTime timestamp;
+
+        gst_event_parse_qos (event, &type, &proportion, &diff, &timestamp);
+
+        GST_OBJECT_LOCK (self);
+        if (self->qos_threshold && diff > 0 &&
+                (guint64) diff > self->qos_threshold &&
+                GST_CLOCK_TIME_IS_VALID (timestamp))
+            self->qos_position = timestamp + diff;
+        GST_OBJECT_UNLOCK (self);
+    }
+
+    return GST_BASE_SRC_CLASS (gst_espeak_parent_class)->event (self_, event);
 }
 
 static GstCaps *gst_espeak_getcaps (GstBaseSrc * self_, GstCaps * filter) {
@@ -301,6 +840,109 @@ static GstCaps *gst_espeak_getcaps (GstBaseSrc * self_, GstCaps * filter) {
 
 /******************************************************************************/
 
+static guint gst_espeak_prepare (GstEspeak * self, const gchar * text) {
+    if (text == NULL || *text == 0)
+        return 0;
+
+    GST_OBJECT_LOCK (self);
+    struct _Econtext *prepared = espeak_prepare (self->speak, text);
+    guint handle = ++self->prepared_handle;
+    if (handle == 0)
+        handle = ++self->prepared_handle;
+    g_hash_table_insert (self->prepared, GUINT_TO_POINTER (handle), prepared);
+    GST_OBJECT_UNLOCK (self);
+
+    GST_DEBUG_OBJECT (self, "prepared %u", handle);
+
+    return handle;
+}
+
+static gboolean gst_espeak_play (GstEspeak * self, guint handle) {
+    GST_OBJECT_LOCK (self);
+    struct _Econtext *prepared = g_hash_table_lookup (self->prepared,
+            GUINT_TO_POINTER (handle));
+    struct _Econtext *dropped = NULL;
+    if (prepared) {
+        g_hash_table_steal (self->prepared, GUINT_TO_POINTER (handle));
+        dropped = self->next_speak;
+        self->next_speak = prepared;
+    }
+    GST_OBJECT_UNLOCK (self);
+
+    if (dropped)
+        espeak_unref (dropped);
+
+    GST_DEBUG_OBJECT (self, "play %u found=%d", handle, prepared != NULL);
+
+    return prepared != NULL;
+}
+
+static gboolean gst_espeak_discard (GstEspeak * self, guint handle) {
+    GST_OBJECT_LOCK (self);
+    struct _Econtext *prepared = g_hash_table_lookup (self->prepared,
+            GUINT_TO_POINTER (handle));
+    if (prepared)
+        g_hash_table_steal (self->prepared, GUINT_TO_POINTER (handle));
+    GST_OBJECT_UNLOCK (self);
+
+    if (prepared)
+        espeak_unref (prepared);
+
+    GST_DEBUG_OBJECT (self, "discard %u found=%d", handle, prepared != NULL);
+
+    return prepared != NULL;
+}
+
+static gboolean gst_espeak_replay (GstEspeak * self, guint utterance,
+        guint start, guint end) {
+    GST_OBJECT_LOCK (self);
+    gboolean found = utterance < espeak_get_history_size (self->speak);
+    if (found) {
+        self->replay = TRUE;
+        self->replay_utterance = utterance;
+        self->replay_start = start;
+        self->replay_end = end;
+    }
+    GST_OBJECT_UNLOCK (self);
+
+    GST_DEBUG_OBJECT (self, "replay %u [%u, %u) found=%d", utterance, start,
+            end, found);
+
+    return found;
+}
+
+static gint gst_espeak_preload (GstEspeak * self, const gchar * voices) {
+    if (voices == NULL || *voices == 0)
+        return 0;
+
+    GstClockTime start = gst_util_get_timestamp ();
+    gint count = espeak_preload (voices);
+    GstClockTime duration = gst_util_get_timestamp () - start;
+
+    GST_DEBUG_OBJECT (self, "preloaded %d voices in %" GST_TIME_FORMAT,
+            count, GST_TIME_ARGS (duration));
+
+    gst_element_post_message (GST_ELEMENT (self),
+            gst_message_new_element (GST_OBJECT (self),
+                    gst_structure_new ("espeak-preloaded",
+                            "voices", G_TYPE_STRING, voices,
+                            "count", G_TYPE_INT, count,
+                            "duration", G_TYPE_UINT64, duration, NULL)));
+
+    return count;
+}
+
+static gpointer gst_espeak_preload_thread (gpointer data) {
+    GstEspeak *self = GST_ESPEAK (data);
+
+    gst_espeak_preload (self, g_getenv ("GST_ESPEAK_PRELOAD"));
+    gst_object_unref (self);
+
+    return NULL;
+}
+
+/******************************************************************************/
+
 static GstURIType gst_espeak_uri_get_type (GType type) {
     return GST_URI_SRC;
 }
@@ -366,7 +1008,9 @@ static gboolean espeak_init (GstPlugin * espeak) {
     GST_DEBUG_CATEGORY_INIT (gst_espeak_debug, "espeak", 0, "Template espeak");
 
     return gst_element_register (espeak, "espeak", GST_RANK_NONE,
-            GST_TYPE_ESPEAK);
+            GST_TYPE_ESPEAK) &&
+            gst_element_register (espeak, "espeakmix", GST_RANK_NONE,
+            GST_TYPE_ESPEAK_MIX);
 }
 
 GST_PLUGIN_DEFINE (GST_VERSION_MAJOR,
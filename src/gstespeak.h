@@ -43,18 +43,43 @@ struct _GstEspeak {
     GstAudioSrc parent;
     struct _Econtext *speak;
     gchar *text;
+    GstStructure *slots;
     gint pitch;
     gint rate;
     gchar *voice;
     guint gap;
     guint track;
+    gboolean stretch;
+    gboolean random_access;
     GValueArray *voices;
     GstCaps *caps;
     gboolean poll;
+    guint64 qos_threshold;
+    GstClockTime qos_position;
+    guint64 skipped_samples;
+    gboolean adaptive;
+    GstClockTime initial_buffer_time;
+    GstClockTime max_buffer_time;
+    GstClockTime buffer_time;
+    GHashTable *prepared;
+    guint prepared_handle;
+    struct _Econtext *next_speak;
+    guint history_size;
+    gboolean replay;
+    guint replay_utterance;
+    guint replay_start;
+    guint replay_end;
 };
 
 struct _GstEspeakClass {
     GstAudioSrcClass parent_class;
+
+    /* actions */
+    guint (*prepare) (GstEspeak *, const gchar *);
+    gboolean (*play) (GstEspeak *, guint);
+    gboolean (*discard) (GstEspeak *, guint);
+    gboolean (*replay) (GstEspeak *, guint, guint, guint);
+    gint (*preload) (GstEspeak *, const gchar *);
 };
 
 GType gst_espeak_get_type (void);
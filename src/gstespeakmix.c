@@ -0,0 +1,517 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/**
+ * SECTION:element-espeakmix
+ *
+ * Speak several utterances at once, each with its own voice, gain, pan
+ * and start time, mixed into one stereo stream. Tracks are mixed as their
+ * sound is synthesized, a track which is not ready yet is silent meanwhile
+ * instead of holding up the others.
+ *
+ * <refsect2>
+ * <title>Example</title>
+ * |[
+ * g_signal_emit_by_name (mix, "add", "Hello", "en", (guint64) 0, 1.0,
+ *         -0.5, &id);
+ * g_signal_emit_by_name (mix, "add", "Hallo", "de", GST_SECOND / 2, 1.0,
+ *         0.5, &id);
+ * g_signal_emit_by_name (mix, "end");
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+#include <string.h>
+
+#include "gstespeakmix.h"
+#include "espeak.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_espeak_mix_debug);
+#define GST_CAT_DEFAULT gst_espeak_mix_debug
+
+#define CHANNELS 2
+#define BYTES_PER_SAMPLE 2
+#define BYTES_PER_FRAME (CHANNELS * BYTES_PER_SAMPLE)
+
+// fixed point gains, 1.0 is 1 << GAIN_SHIFT
+#define GAIN_SHIFT 12
+#define MAX_GAIN 4.0
+
+enum {
+    PROP_0,
+    PROP_PITCH,
+    PROP_RATE,
+    PROP_GAP,
+    PROP_CAPS
+};
+
+enum {
+    SIGNAL_ADD,
+    SIGNAL_END,
+    LAST_SIGNAL
+};
+
+static guint gst_espeak_mix_signals[LAST_SIGNAL] = { 0 };
+
+typedef struct {
+    guint id;
+    struct _Econtext *speak;
+    gchar *voice;
+    // frame of the output the track starts at
+    guint64 start;
+    gint32 left;
+    gint32 right;
+    // sound of the track which is not mixed yet
+    GstBuffer *pending;
+    gsize offset;
+} GstEspeakMixTrack;
+
+static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
+        GST_PAD_SRC,
+        GST_PAD_ALWAYS,
+        GST_STATIC_CAPS_ANY);
+
+static GstFlowReturn gst_espeak_mix_fill (GstBaseSrc *, guint64, guint,
+        GstBuffer *);
+static gboolean gst_espeak_mix_start (GstBaseSrc *);
+static gboolean gst_espeak_mix_stop (GstBaseSrc *);
+static gboolean gst_espeak_mix_unlock (GstBaseSrc *);
+static gboolean gst_espeak_mix_unlock_stop (GstBaseSrc *);
+static GstCaps *gst_espeak_mix_getcaps (GstBaseSrc *, GstCaps *);
+static void gst_espeak_mix_finalize (GObject *);
+static void gst_espeak_mix_set_property (GObject *, guint, const GValue *,
+        GParamSpec *);
+static void gst_espeak_mix_get_property (GObject *, guint, GValue *,
+        GParamSpec *);
+static guint gst_espeak_mix_add (GstEspeakMix *, const gchar *,
+        const gchar *, guint64, gdouble, gdouble);
+static void gst_espeak_mix_end (GstEspeakMix *);
+
+G_DEFINE_TYPE_WITH_CODE (GstEspeakMix, gst_espeak_mix, GST_TYPE_BASE_SRC,
+        GST_DEBUG_CATEGORY_INIT (gst_espeak_mix_debug, "espeakmix", 0,
+                "eSpeak mixer"));
+
+/******************************************************************************/
+
+static void gst_espeak_mix_class_init (GstEspeakMixClass * klass) {
+    GObjectClass *gobject_class = (GObjectClass *) klass;
+    GstBaseSrcClass *basesrc_class = (GstBaseSrcClass *) klass;
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+    basesrc_class->fill = gst_espeak_mix_fill;
+    basesrc_class->start = gst_espeak_mix_start;
+    basesrc_class->stop = gst_espeak_mix_stop;
+    basesrc_class->unlock = gst_espeak_mix_unlock;
+    basesrc_class->unlock_stop = gst_espeak_mix_unlock_stop;
+    basesrc_class->get_caps = gst_espeak_mix_getcaps;
+
+    gobject_class->finalize = gst_espeak_mix_finalize;
+    gobject_class->set_property = gst_espeak_mix_set_property;
+    gobject_class->get_property = gst_espeak_mix_get_property;
+
+    klass->add = gst_espeak_mix_add;
+    klass->end = gst_espeak_mix_end;
+
+    g_object_class_install_property (gobject_class, PROP_PITCH,
+            g_param_spec_int ("pitch", "Pitch adjustment",
+                    "Pitch adjustment of tracks added afterwards",
+                    -100, 100, 0,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_RATE,
+            g_param_spec_int ("rate", "Speed in words per minute",
+                    "Speed in words per minute of tracks added afterwards",
+                    -100, 100, 0,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_GAP,
+            g_param_spec_uint ("gap", "Gap",
+                    "Word gap of tracks added afterwards", 0, G_MAXINT, 0,
+                    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (gobject_class, PROP_CAPS,
+            g_param_spec_boxed ("caps", "Caps",
+                    "Caps describing the format of the data", GST_TYPE_CAPS,
+                    G_PARAM_READABLE));
+
+    /* speak text with voice from start (in ns of the output), gain and
+     * pan (-1 is left, 1 is right) and return the track id; tracks can
+     * be added before and while playing, the mixer waits for more tracks
+     * until "end" */
+    gst_espeak_mix_signals[SIGNAL_ADD] =
+            g_signal_new ("add", G_TYPE_FROM_CLASS (klass),
+            G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+            G_STRUCT_OFFSET (GstEspeakMixClass, add), NULL, NULL, NULL,
+            G_TYPE_UINT, 5, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_UINT64,
+            G_TYPE_DOUBLE, G_TYPE_DOUBLE);
+
+    /* end the stream once tracks added so far are spoken */
+    gst_espeak_mix_signals[SIGNAL_END] =
+            g_signal_new ("end", G_TYPE_FROM_CLASS (klass),
+            G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+            G_STRUCT_OFFSET (GstEspeakMixClass, end), NULL, NULL, NULL,
+            G_TYPE_NONE, 0);
+
+    gst_element_class_add_pad_template (element_class,
+            gst_static_pad_template_get (&src_factory));
+
+    gst_element_class_set_metadata (element_class,
+            "eSpeak mixer as a sound source",
+            "Source/Audio",
+            "Mix several eSpeak utterances into one stream",
+            "Aleksey Lim <alsroot@sugarlabs.org>");
+}
+
+static void gst_espeak_mix_init (GstEspeakMix * self) {
+    GstAudioFormat format;
+    format = gst_audio_format_build_integer (TRUE, G_BYTE_ORDER, 16, 16);
+
+    self->caps = gst_caps_new_simple ("audio/x-raw",
+            "format", G_TYPE_STRING, gst_audio_format_to_string (format),
+            "layout", G_TYPE_STRING, "interleaved",
+            "rate", G_TYPE_INT, espeak_get_sample_rate (),
+            "channels", G_TYPE_INT, CHANNELS, NULL);
+    self->cond = g_cond_new ();
+
+    gst_base_src_set_format (GST_BASE_SRC (self), GST_FORMAT_TIME);
+    gst_base_src_set_blocksize (GST_BASE_SRC (self),
+            espeak_get_buffer_size () * CHANNELS);
+}
+
+static void track_free (GstEspeakMixTrack * track) {
+    if (track->pending)
+        gst_buffer_unref (track->pending);
+    espeak_unref (track->speak);
+    g_free (track->voice);
+    g_free (track);
+}
+
+static void gst_espeak_mix_clear (GstEspeakMix * self) {
+    GST_OBJECT_LOCK (self);
+    GList *added = self->added;
+    self->added = NULL;
+    self->ended = FALSE;
+    GST_OBJECT_UNLOCK (self);
+
+    g_list_free_full (added, (GDestroyNotify) track_free);
+    g_list_free_full (self->tracks, (GDestroyNotify) track_free);
+    self->tracks = NULL;
+}
+
+static void gst_espeak_mix_finalize (GObject * self_) {
+    GstEspeakMix *self = GST_ESPEAK_MIX (self_);
+
+    gst_espeak_mix_clear (self);
+    g_free (self->mix);
+    self->mix = NULL;
+    gst_caps_unref (self->caps);
+    self->caps = NULL;
+    g_cond_free (self->cond);
+    self->cond = NULL;
+
+    G_OBJECT_CLASS (gst_espeak_mix_parent_class)->finalize (self_);
+}
+
+/******************************************************************************/
+
+static void
+gst_espeak_mix_set_property (GObject * object, guint prop_id,
+        const GValue * value, GParamSpec * pspec) {
+    GstEspeakMix *self = GST_ESPEAK_MIX (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id) {
+    case PROP_PITCH:
+        self->pitch = g_value_get_int (value);
+        break;
+    case PROP_RATE:
+        self->rate = g_value_get_int (value);
+        break;
+    case PROP_GAP:
+        self->gap = g_value_get_uint (value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+static void
+gst_espeak_mix_get_property (GObject * object, guint prop_id,
+        GValue * value, GParamSpec * pspec) {
+    GstEspeakMix *self = GST_ESPEAK_MIX (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id) {
+    case PROP_PITCH:
+        g_value_set_int (value, self->pitch);
+        break;
+    case PROP_RATE:
+        g_value_set_int (value, self->rate);
+        break;
+    case PROP_GAP:
+        g_value_set_uint (value, self->gap);
+        break;
+    case PROP_CAPS:
+        gst_value_set_caps (value, self->caps);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+/******************************************************************************/
+
+// accumulate mono sound into the stereo mix; plain loops over restrict
+// pointers, so the compiler turns them into SIMD code, see
+// VECTORIZE_CFLAGS in configure.ac
+static void mix_add (gint32 * restrict mix, const gint16 * restrict sound,
+        gsize frames, gint32 left, gint32 right) {
+    gsize i;
+
+    for (i = 0; i < frames; ++i) {
+        mix[i * CHANNELS] += (sound[i] * left) >> GAIN_SHIFT;
+        mix[i * CHANNELS + 1] += (sound[i] * right) >> GAIN_SHIFT;
+    }
+}
+
+// saturate the mix to 16 bit samples
+static void mix_store (gint16 * restrict out, const gint32 * restrict mix,
+        gsize samples) {
+    gsize i;
+
+    for (i = 0; i < samples; ++i)
+        out[i] = CLAMP (mix[i], G_MININT16, G_MAXINT16);
+}
+
+// mix frames of the track at the current position, returns FALSE once the
+// track is spoken; a track which is still synthesizing is silent for the
+// rest of the block instead of holding up the others
+static gboolean gst_espeak_mix_track (GstEspeakMix * self,
+        GstEspeakMixTrack * track, gsize frames) {
+    gsize i = 0;
+
+    if (track->start > self->position) {
+        if (track->start - self->position >= frames)
+            return TRUE;
+        i = track->start - self->position;
+    }
+
+    while (i < frames) {
+        if (track->pending == NULL) {
+            if (!espeak_ready (track->speak)) {
+                GST_LOG_OBJECT (self, "track %u is not ready, %"
+                        G_GSIZE_FORMAT " silent frames", track->id,
+                        frames - i);
+                return TRUE;
+            }
+            track->pending = espeak_out (track->speak,
+                    (frames - i) * BYTES_PER_SAMPLE);
+            track->offset = 0;
+            if (track->pending == NULL)
+                return FALSE;
+        }
+
+        GstMapInfo map;
+        gst_buffer_map (track->pending, &map, GST_MAP_READ);
+        gsize size = map.size;
+        gsize count = MIN ((size - track->offset) / BYTES_PER_SAMPLE,
+                frames - i);
+
+        mix_add (self->mix + i * CHANNELS,
+                (const gint16 *) (map.data + track->offset), count,
+                track->left, track->right);
+        gst_buffer_unmap (track->pending, &map);
+
+        track->offset += count * BYTES_PER_SAMPLE;
+        i += count;
+
+        if (count == 0 || track->offset >= size) {
+            gst_buffer_unref (track->pending);
+            track->pending = NULL;
+        }
+    }
+
+    return TRUE;
+}
+
+static GstFlowReturn
+gst_espeak_mix_fill (GstBaseSrc * self_, guint64 offset, guint size,
+        GstBuffer * buf) {
+    GstEspeakMix *self = GST_ESPEAK_MIX (self_);
+    gsize frames = size / BYTES_PER_FRAME;
+    GList *i, *next;
+
+    GST_OBJECT_LOCK (self);
+    while (self->tracks == NULL && self->added == NULL && !self->ended &&
+            !self->flushing)
+        g_cond_wait (self->cond, GST_OBJECT_GET_LOCK (self));
+    if (self->flushing) {
+        GST_OBJECT_UNLOCK (self);
+        return GST_FLOW_FLUSHING;
+    }
+    self->tracks = g_list_concat (self->tracks, self->added);
+    self->added = NULL;
+    GST_OBJECT_UNLOCK (self);
+
+    // nothing left to speak after "end"
+    if (self->tracks == NULL || frames == 0)
+        return GST_FLOW_EOS;
+
+    if (frames > self->mix_frames) {
+        self->mix = g_renew (gint32, self->mix, frames * CHANNELS);
+        self->mix_frames = frames;
+    }
+    memset (self->mix, 0, frames * CHANNELS * sizeof (gint32));
+
+    for (i = self->tracks; i; i = next) {
+        GstEspeakMixTrack *track = i->data;
+
+        next = i->next;
+        if (!gst_espeak_mix_track (self, track, frames)) {
+            GST_DEBUG_OBJECT (self, "track %u is spoken", track->id);
+            self->tracks = g_list_delete_link (self->tracks, i);
+            track_free (track);
+        }
+    }
+
+    GstMapInfo map;
+    gst_buffer_map (buf, &map, GST_MAP_WRITE);
+    mix_store ((gint16 *) map.data, self->mix, frames * CHANNELS);
+    gst_buffer_unmap (buf, &map);
+    gst_buffer_set_size (buf, frames * BYTES_PER_FRAME);
+
+    gint rate = espeak_get_sample_rate ();
+
+    GST_BUFFER_OFFSET (buf) = self->position;
+    GST_BUFFER_TIMESTAMP (buf) = gst_util_uint64_scale_int (self->position,
+            GST_SECOND, rate);
+    self->position += frames;
+    GST_BUFFER_OFFSET_END (buf) = self->position;
+    GST_BUFFER_DURATION (buf) = gst_util_uint64_scale_int (self->position,
+            GST_SECOND, rate) - GST_BUFFER_TIMESTAMP (buf);
+
+    return GST_FLOW_OK;
+}
+
+static gboolean gst_espeak_mix_start (GstBaseSrc * self_) {
+    GstEspeakMix *self = GST_ESPEAK_MIX (self_);
+
+    self->position = 0;
+    gst_base_src_set_caps (self_, self->caps);
+
+    return TRUE;
+}
+
+static gboolean gst_espeak_mix_stop (GstBaseSrc * self_) {
+    gst_espeak_mix_clear (GST_ESPEAK_MIX (self_));
+    return TRUE;
+}
+
+static gboolean gst_espeak_mix_unlock (GstBaseSrc * self_) {
+    GstEspeakMix *self = GST_ESPEAK_MIX (self_);
+
+    GST_OBJECT_LOCK (self);
+    self->flushing = TRUE;
+    g_cond_broadcast (self->cond);
+    GST_OBJECT_UNLOCK (self);
+
+    return TRUE;
+}
+
+static gboolean gst_espeak_mix_unlock_stop (GstBaseSrc * self_) {
+    GstEspeakMix *self = GST_ESPEAK_MIX (self_);
+
+    GST_OBJECT_LOCK (self);
+    self->flushing = FALSE;
+    GST_OBJECT_UNLOCK (self);
+
+    return TRUE;
+}
+
+static GstCaps *gst_espeak_mix_getcaps (GstBaseSrc * self_, GstCaps * filter) {
+    GstEspeakMix *self = GST_ESPEAK_MIX (self_);
+
+    if (filter)
+        return gst_caps_intersect_full (filter, self->caps,
+                GST_CAPS_INTERSECT_FIRST);
+    return gst_caps_ref (self->caps);
+}
+
+/******************************************************************************/
+
+static guint gst_espeak_mix_add (GstEspeakMix * self, const gchar * text,
+        const gchar * voice, guint64 start, gdouble gain, gdouble pan) {
+    if (text == NULL || *text == 0)
+        return 0;
+
+    GstEspeakMixTrack *track = g_new0 (GstEspeakMixTrack, 1);
+
+    track->speak = espeak_new (GST_ELEMENT (self));
+    track->voice = g_strdup (voice && *voice ? voice :
+            espeak_default_voice ());
+    track->start = gst_util_uint64_scale_int (start,
+            espeak_get_sample_rate (), GST_SECOND);
+
+    gain = CLAMP (gain, 0, MAX_GAIN);
+    pan = CLAMP (pan, -1, 1);
+    track->left = gain * MIN (1 - pan, 1) * (1 << GAIN_SHIFT);
+    track->right = gain * MIN (1 + pan, 1) * (1 << GAIN_SHIFT);
+
+    GST_OBJECT_LOCK (self);
+    espeak_set_pitch (track->speak, self->pitch);
+    espeak_set_rate (track->speak, self->rate);
+    espeak_set_gap (track->speak, self->gap);
+    GST_OBJECT_UNLOCK (self);
+    espeak_set_voice (track->speak, track->voice);
+
+    // synthesis starts right away in the process thread
+    espeak_in (track->speak, text);
+
+    GST_DEBUG_OBJECT (self, "voice=%s start=%" G_GUINT64_FORMAT
+            " gain=%f pan=%f", track->voice, track->start, gain, pan);
+
+    // the streaming thread owns the track once it is added
+    GST_OBJECT_LOCK (self);
+    guint id = ++self->last_track;
+    if (id == 0)
+        id = ++self->last_track;
+    track->id = id;
+    self->added = g_list_append (self->added, track);
+    g_cond_broadcast (self->cond);
+    GST_OBJECT_UNLOCK (self);
+
+    return id;
+}
+
+static void gst_espeak_mix_end (GstEspeakMix * self) {
+    GST_OBJECT_LOCK (self);
+    self->ended = TRUE;
+    g_cond_broadcast (self->cond);
+    GST_OBJECT_UNLOCK (self);
+
+    GST_DEBUG_OBJECT (self, "end");
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef __GST_ESPEAK_MIX_H__
+#define __GST_ESPEAK_MIX_H__
+
+#include <gst/gst.h>
+#include <gst/base/gstbasesrc.h>
+
+G_BEGIN_DECLS
+#define GST_TYPE_ESPEAK_MIX \
+  (gst_espeak_mix_get_type())
+#define GST_ESPEAK_MIX(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_ESPEAK_MIX,GstEspeakMix))
+#define GST_ESPEAK_MIX_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_ESPEAK_MIX,GstEspeakMixClass))
+#define GST_IS_ESPEAK_MIX(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_ESPEAK_MIX))
+#define GST_IS_ESPEAK_MIX_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_ESPEAK_MIX))
+typedef struct _GstEspeakMix GstEspeakMix;
+typedef struct _GstEspeakMixClass GstEspeakMixClass;
+
+struct _GstEspeakMix {
+    GstBaseSrc parent;
+    GstCaps *caps;
+    gint pitch;
+    gint rate;
+    guint gap;
+    // tracks added by "add", taken over by the streaming thread
+    GList *added;
+    guint last_track;
+    // signalled on "add", "end" and unlock
+    GCond *cond;
+    gboolean ended;
+    gboolean flushing;
+    // streaming thread only
+    GList *tracks;
+    guint64 position;
+    gint32 *mix;
+    gsize mix_frames;
+};
+
+struct _GstEspeakMixClass {
+    GstBaseSrcClass parent_class;
+
+    /* actions */
+    guint (*add) (GstEspeakMix *, const gchar * text, const gchar * voice,
+            guint64 start, gdouble gain, gdouble pan);
+    void (*end) (GstEspeakMix *);
+};
+
+GType gst_espeak_mix_get_type (void);
+
+G_END_DECLS
+#endif /* __GST_ESPEAK_MIX_H__ */
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Pitch preserving time-stretching (WSOLA) of already synthesized sound.
+ *
+ * Every output hop is the overlap-add of two Hann windowed input frames,
+ * the next frame is searched around its nominal input position for the
+ * best match with the natural continuation of the previous one.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+
+#include "stretch.h"
+
+#define STRETCH_FRAME_MS 20
+#define STRETCH_SEARCH_MS 5
+
+struct _Estretch {
+    gint frame;
+    gint hop;
+    gint search;
+
+    gfloat *window;
+    gfloat *tail;
+
+    gdouble position;
+    gint64 previous;
+    gboolean primed;
+};
+
+Estretch *stretch_new (gint sample_rate) {
+    Estretch *self = g_new0 (Estretch, 1);
+    gint i;
+
+    self->hop = MAX (16, sample_rate * STRETCH_FRAME_MS / 1000 / 2);
+    self->frame = self->hop * 2;
+    self->search = sample_rate * STRETCH_SEARCH_MS / 1000;
+
+    self->window = g_new (gfloat, self->frame);
+    for (i = 0; i < self->frame; ++i)
+        self->window[i] = 0.5 - 0.5 * cos (2 * G_PI * i / self->frame);
+
+    self->tail = g_new0 (gfloat, self->hop);
+
+    return self;
+}
+
+void stretch_free (Estretch * self) {
+    g_free (self->window);
+    g_free (self->tail);
+    g_free (self);
+}
+
+static inline gint16 sample_at (const gint16 * input, gsize input_len,
+        gint64 position) {
+    if (position < 0 || position >= (gint64) input_len)
+        return 0;
+    return input[position];
+}
+
+void stretch_reset (Estretch * self, gsize position) {
+    // pretend that the sound before position was output by a frame which
+    // started one hop earlier, so its falling half is the current tail
+    self->position = position;
+    self->previous = (gint64) position - self->hop;
+    self->primed = FALSE;
+}
+
+gdouble stretch_position (Estretch * self) {
+    return self->position;
+}
+
+static gsize frames_to (Estretch * self, gsize end, gdouble factor) {
+    if (self->position >= end)
+        return 0;
+    return (gsize) ceil ((end - self->position) / (self->hop * factor));
+}
+
+gsize stretch_output_size (Estretch * self, gsize end, gdouble factor,
+        gboolean flush) {
+    return (frames_to (self, end, factor) + (flush ? 1 : 0)) * self->hop;
+}
+
+// plain loop over contiguous samples for the compiler to vectorize, see
+// VECTORIZE_CFLAGS in configure.ac
+static gint64 correlate (const gint16 * restrict a,
+        const gint16 * restrict b, gint len) {
+    gint64 sum = 0;
+    gint i;
+
+    for (i = 0; i < len; ++i)
+        sum += (gint32) a[i] * b[i];
+
+    return sum;
+}
+
+static gint64 best_offset (Estretch * self, const gint16 * input,
+        gsize input_len, gint64 nominal) {
+    gint64 target = self->previous + self->hop;
+    gint64 from = MAX (0, nominal - self->search);
+    gint64 to = MIN (nominal + self->search, (gint64) input_len - self->hop);
+    gint64 best = nominal;
+    gint64 best_sum = G_MININT64;
+    gint64 i;
+
+    if (target < 0 || target + self->hop > (gint64) input_len || from > to)
+        return nominal;
+
+    for (i = from; i <= to; ++i) {
+        gint64 sum = correlate (input + target, input + i, self->hop);
+        if (sum > best_sum) {
+            best_sum = sum;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+static inline gint16 clip (gfloat value) {
+    return (gint16) CLAMP (lrintf (value), G_MININT16, G_MAXINT16);
+}
+
+gsize stretch_process (Estretch * self, const gint16 * input, gsize input_len,
+        gsize end, gdouble factor, gboolean flush, gint16 * output) {
+    gsize frames = frames_to (self, end, factor);
+    gint hop = self->hop;
+    gsize frame;
+    gint i;
+
+    if (!self->primed) {
+        for (i = 0; i < hop; ++i)
+            self->tail[i] = sample_at (input, input_len, self->previous +
+                    hop + i) * self->window[hop + i];
+        self->primed = TRUE;
+    }
+
+    for (frame = 0; frame < frames; ++frame) {
+        gint64 start = best_offset (self, input, input_len,
+                (gint64) self->position);
+
+        for (i = 0; i < hop; ++i)
+            output[i] = clip (self->tail[i] +
+                    sample_at (input, input_len, start + i) * self->window[i]);
+        for (i = 0; i < hop; ++i)
+            self->tail[i] = sample_at (input, input_len, start + hop + i) *
+                    self->window[hop + i];
+
+        output += hop;
+        self->previous = start;
+        self->position += hop * factor;
+    }
+
+    if (flush) {
+        for (i = 0; i < hop; ++i)
+            output[i] = clip (self->tail[i]);
+        memset (self->tail, 0, hop * sizeof (gfloat));
+        ++frames;
+    }
+
+    return frames * hop;
+}
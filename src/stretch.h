@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2009, Aleksey Lim <alsroot@sugarlabs.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef STRETCH_H
+#define STRETCH_H
+
+struct _Estretch;
+typedef struct _Estretch Estretch;
+
+Estretch *stretch_new (gint sample_rate);
+void stretch_free (Estretch *);
+
+/* start stretching from input sample position */
+void stretch_reset (Estretch *, gsize position);
+gdouble stretch_position (Estretch *);
+
+/* number of samples stretch_process() will output to reach input sample
+ * end, with factor > 1 for faster speech */
+gsize stretch_output_size (Estretch *, gsize end, gdouble factor,
+        gboolean flush);
+gsize stretch_process (Estretch *, const gint16 * input, gsize input_len,
+        gsize end, gdouble factor, gboolean flush, gint16 * output);
+
+#endif